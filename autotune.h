@@ -0,0 +1,134 @@
+#ifndef AUTOTUNE_H_
+#define AUTOTUNE_H_
+
+#include "camera3d.h"
+#include "scene3d.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Render settings of a camera that autotune() chooses between.
+struct render_config {
+	int num_threads;
+	int tile_size;
+	int chunk_rows;
+	bool wavefront;
+	bool frustum_culling;
+	
+	explicit render_config(const camera3d &camera)
+		: num_threads(camera.threads())
+		, tile_size(camera.tile_size)
+		, chunk_rows(camera.chunk_rows)
+		, wavefront(camera.wavefront)
+		, frustum_culling(camera.frustum_culling)
+	{}
+	
+	void apply(camera3d &camera) const {
+		camera.num_threads = num_threads;
+		camera.tile_size = tile_size;
+		camera.chunk_rows = chunk_rows;
+		camera.wavefront = wavefront;
+		camera.frustum_culling = frustum_culling;
+	}
+};
+
+// Best time of rendering three bands of rows across the frame, or the whole
+// frame if they would cover most of it.
+double probe(const scene3d &scene, camera3d camera, const render_config &config, int rows) {
+	config.apply(camera);
+	rows = std::min(camera.height, rows);
+	const int bands = rows * 3 < camera.height ? 3 : 1;
+	if (bands == 1)
+		rows = camera.height;
+	const size_t size = (size_t)rows * camera.width * 3;
+	std::unique_ptr<uint8_t[]> data(new uint8_t[size]);
+	double best = 0;
+	for (int k = 0; k < 2; ++k) {
+		auto start = std::chrono::steady_clock::now();
+		for (int band = 1; band <= bands; ++band) {
+			const int first = std::max(0, std::min(camera.height - rows, camera.height * band / 4 - rows / 2));
+			render(scene, camera, data.get(), size, camera.width * 3, PIXEL_RGB, region2d{0, first, camera.width, rows});
+		}
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		if (k == 0 || elapsed.count() < best)
+			best = elapsed.count();
+	}
+	return best;
+}
+
+// Picks the fastest render settings for this host, scene and resolution by
+// timing probe bands of the actual frame, one setting at a time, and applies
+// them to camera. Results are cached in cache_path, keyed by host name, scene
+// hash, resolution and probe height, so later runs on the same host skip the
+// probes.
+render_config autotune(const scene3d &scene, camera3d &camera, const char *cache_path = "autotune.txt") {
+	// Bands are the same for every setting and give each thread at least one
+	// chunk of rows at the largest thread count and chunk size tried, so
+	// that every thread count is actually measured.
+	const int max_threads = render_config(camera).num_threads;
+	const int rows = std::min(camera.height, std::max(16, max_threads * std::max(8, camera.chunk_rows)));
+	char host[256] = "unknown";
+	gethostname(host, sizeof(host) - 1);
+	std::ostringstream key;
+	key << host << ' ' << std::hex << scene.hash() << std::dec << ' ' << camera.width << 'x' << camera.height
+	    << ' ' << rows;
+	render_config best(camera);
+	{
+		std::ifstream fin(cache_path);
+		std::string line;
+		const std::string prefix = key.str() + ' ';
+		while (std::getline(fin, line)) {
+			if (line.compare(0, prefix.size(), prefix) != 0)
+				continue;
+			std::istringstream values(line.substr(prefix.size()));
+			if (values >> best.num_threads >> best.tile_size >> best.chunk_rows >> best.wavefront >> best.frustum_culling) {
+				best.apply(camera);
+				return best;
+			}
+		}
+	}
+	double best_time = probe(scene, camera, best, rows);
+	auto attempt = [&](const render_config &config) {
+		const double time = probe(scene, camera, config, rows);
+		if (time < best_time) {
+			best = config;
+			best_time = time;
+		}
+	};
+	render_config config = best;
+	for (int threads = max_threads; threads >= 1; threads /= 2) {
+		config = best;
+		config.num_threads = threads;
+		attempt(config);
+	}
+	for (int tile_size : { 8, 16, 32, 64 }) {
+		config = best;
+		config.tile_size = tile_size;
+		attempt(config);
+	}
+	for (int chunk_rows : { 1, 2, 4, 8 }) {
+		config = best;
+		config.chunk_rows = chunk_rows;
+		attempt(config);
+	}
+	config = best;
+	config.wavefront = !config.wavefront;
+	attempt(config);
+	config = best;
+	config.frustum_culling = !config.frustum_culling;
+	attempt(config);
+	std::ofstream fout(cache_path, std::ios::app);
+	fout << key.str() << ' ' << best.num_threads << ' ' << best.tile_size << ' ' << best.chunk_rows
+	     << ' ' << best.wavefront << ' ' << best.frustum_culling << std::endl;
+	best.apply(camera);
+	return best;
+}
+
+#endif
@@ -3,11 +3,32 @@
 
 #include "vector3d.h"
 #include "scene3d.h"
+#include "numa_placement.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <iostream>
 #include <fstream>
 #include <memory>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+enum pixel_format {
+	PIXEL_RGB,
+	PIXEL_RGBA,
+};
+
+// Sub-rectangle of an image in pixels.
+struct region2d {
+	int x;
+	int y;
+	int width;
+	int height;
+};
 
 class camera3d {
 public:
@@ -15,6 +36,35 @@ public:
 	float fov;
 	int width;
 	int height;
+	int max_depth;
+	int max_layers;
+	// Traces each row as one wavefront batch instead of ray by ray.
+	bool wavefront;
+	// Tests primary rays only against objects inside their tile's frustum.
+	bool frustum_culling;
+	// Side of the square screen tiles used for frustum culling.
+	int tile_size;
+	// Render threads, 0 leaves the choice to OpenMP.
+	int num_threads;
+	// Rows handed to a thread at a time.
+	int chunk_rows;
+	// Pins render threads across the NUMA nodes and has each node render its
+	// own page-sized bands, so that framebuffer pages are first touched by
+	// the node that writes them. Applies to render() and render_to_file(),
+	// render_to_files() and render_to_file_streaming() keep their shared
+	// schedules.
+	bool numa_placement;
+	
+	// Objects that primary rays of each tile may hit, for the rows of tiles
+	// from first_row on; the handles of the k-th tile from there are in
+	// [first[k], first[k + 1]).
+	struct tile_culling {
+		int size;
+		int columns;
+		int first_row;
+		std::vector<int> first;
+		std::vector<scene3d::handle> handles;
+	};
 	
 	camera3d() 
 		: xray(1, 0, 0)
@@ -23,6 +73,14 @@ public:
 		, fov(120)
 		, width(640)
 		, height(480)
+		, max_depth(4)
+		, max_layers(8)
+		, wavefront(false)
+		, frustum_culling(true)
+		, tile_size(16)
+		, num_threads(0)
+		, chunk_rows(1)
+		, numa_placement(false)
 	{}
 	
 	void look_at(const vector3d &point) {
@@ -33,7 +91,8 @@ public:
 		xray.normalize();
 		yray = xray * zray;
 		yray.normalize();
-		const double eps = 1e-7;
+		// Loose enough for the refined rsqrt estimate of float_precision.
+		const double eps = 1e-6;
 		assert(fabs(abs(xray) - 1) < eps);
 		assert(fabs(abs(yray) - 1) < eps);
 		assert(fabs(abs(zray) - 1) < eps);
@@ -42,43 +101,337 @@ public:
 		assert(fabs(dot_product(yray, zray)) < eps);
 	}
 	
-	void render_to_file(const scene3d &scene, const char *path);
+	// Returns false if render() fails, in which case no file is written, or
+	// if the file could not be written.
+	bool render_to_file(const scene3d &scene, const char *path);
+	
+	// Renders bands of band_rows rows in parallel and writes each band as
+	// soon as all bands above it are written. Peak memory depends on the band
+	// size and thread count only; the file is identical to render_to_file().
+	// Returns false as render_to_file() does.
+	bool render_to_file_streaming(const scene3d &scene, const char *path, int band_rows = 16) const;
+	
+	// Per-frame pass that culls the scene against the frustum of each tile
+	// overlapping region, or of the whole image by default.
+	void cull_tiles(const scene3d &scene, tile_culling &tiles, const region2d *region = nullptr) const;
+	
+	int threads() const {
+#ifdef _OPENMP
+		return num_threads > 0 ? num_threads : omp_get_max_threads();
+#else
+		return 1;
+#endif
+	}
+	
+	// Renders row i as packed RGB into row.
+	void render_row(const scene3d &scene, int i, uint8_t *row, const tile_culling *tiles = nullptr) const {
+		render_span(scene, i, 0, width, row, PIXEL_RGB, tiles);
+	}
+	
+	// Renders columns [first, last) of row i into out.
+	void render_span(const scene3d &scene, int i, int first, int last, uint8_t *out, pixel_format format,
+		const tile_culling *tiles = nullptr) const;
+	
+	// Returns false if the file could not be written in full.
+	bool write_ppm(const char *path, const uint8_t *data) const;
 	
 private:
 	vector3d xray;
 	vector3d yray;
 	vector3d zray;
+	
+	// Unnormalized direction through a point of the image plane in pixels.
+	vector3d pixel_direction(double i, double j) const {
+		const double focal_length_inv = 2 * tan(fov / 2) / width;
+		return zray + yray * ((i - (height - 1) * 0.5) * focal_length_inv)
+			+ xray * ((j - (width - 1) * 0.5) * focal_length_inv);
+	}
 };
 
-void camera3d::render_to_file(const scene3d &scene, const char *path) {
-	const double pi = 3.1415926535897932384626433832795;
+void camera3d::cull_tiles(const scene3d &scene, tile_culling &tiles, const region2d *region) const {
+	const int size = tile_size;
+	tiles.size = size;
+	tiles.columns = (width + size - 1) / size;
+	tiles.first_row = region ? region->y / size : 0;
+	const int rows = region ? (region->y + region->height + size - 1) / size : (height + size - 1) / size;
+	tiles.first.assign(1, 0);
+	tiles.handles.clear();
+	for (int ti = tiles.first_row; ti < rows; ++ti) {
+		for (int tj = 0; tj < tiles.columns; ++tj) {
+			if (region && (ti * size >= region->y + region->height || (ti + 1) * size <= region->y
+				|| tj * size >= region->x + region->width || (tj + 1) * size <= region->x)) {
+				tiles.first.push_back((int)tiles.handles.size());
+				continue;
+			}
+			// Side planes past the outer pixel edges of the tile as far as
+			// impostors of objects outside it reach. That is one footprint,
+			// which spans 1 / cos^2 pixels at an angle off the axis, the
+			// squared length of the pixel direction there, so the padding
+			// grows towards the edges of wide images. Taken at the corners
+			// one pixel out and again at the corners that gives.
+			double i0, i1, j0, j1;
+			double pad = 1;
+			for (int k = 0; k < 2; ++k) {
+				i0 = ti * size - 0.5 - pad;
+				i1 = std::min(height, (ti + 1) * size) - 0.5 + pad;
+				j0 = tj * size - 0.5 - pad;
+				j1 = std::min(width, (tj + 1) * size) - 0.5 + pad;
+				for (double i : { i0, i1 }) {
+					for (double j : { j0, j1 }) {
+						const vector3d direction = pixel_direction(i, j);
+						pad = std::max(pad, (double)dot_product(direction, direction));
+					}
+				}
+			}
+			i0 = ti * size - 0.5 - pad;
+			i1 = std::min(height, (ti + 1) * size) - 0.5 + pad;
+			j0 = tj * size - 0.5 - pad;
+			j1 = std::min(width, (tj + 1) * size) - 0.5 + pad;
+			const vector3d corners[4] = {
+				pixel_direction(i0, j0),
+				pixel_direction(i0, j1),
+				pixel_direction(i1, j1),
+				pixel_direction(i1, j0),
+			};
+			const vector3d center = pixel_direction((i0 + i1) * 0.5, (j0 + j1) * 0.5);
+			vector3d normals[4];
+			for (int k = 0; k < 4; ++k) {
+				normals[k] = corners[k] * corners[(k + 1) % 4];
+				if (dot_product(normals[k], center) < 0)
+					normals[k] = -normals[k];
+			}
+			scene.cull(origin, normals, 4, tiles.handles, (float)fabs(2 * tan(fov / 2) / width));
+			tiles.first.push_back((int)tiles.handles.size());
+		}
+	}
+}
+
+void camera3d::render_span(const scene3d &scene, int i, int first, int last, uint8_t *out, pixel_format format,
+	const tile_culling *tiles) const {
 	const double focal_length_inv = 2 * tan(fov / 2) / width;
-	std::unique_ptr<uint8_t[]> data(new uint8_t[width * height * 3]);
 	vector3d dx = xray * focal_length_inv;
 	vector3d dy = yray * focal_length_inv;
-	#pragma omp parallel for
-	for (int i = 0; i < height; ++i) {
-		uint8_t *row = data.get() + i * (width * 3);
-		ray3d ray;
-		ray.origin = origin;
-		vector3d direction = zray + dy * (i - (height - 1) * 0.5) - dx * ((width - 1) * 0.5);
-		for (int j = 0; j < width; ++j) {
+	ray3d ray;
+	ray.origin = origin;
+	ray.spread = (float)fabs(focal_length_inv);
+	vector3d direction = zray + dy * (i - (height - 1) * 0.5) - dx * ((width - 1) * 0.5);
+	// Stepped column by column so that a span matches the same pixels of a
+	// whole row exactly.
+	for (int j = 0; j < first; ++j)
+		direction += dx;
+	std::vector<ray3d> rays;
+	std::vector<color3d> colors;
+	if (wavefront) {
+		rays.resize(last - first);
+		colors.resize(last - first);
+		for (int j = first; j < last; ++j) {
+			rays[j - first].origin = origin;
+			rays[j - first].spread = ray.spread;
+			rays[j - first].direction = direction;
+			rays[j - first].direction.normalize();
+			direction += dx;
+		}
+		scene.trace_wavefront(rays.data(), colors.data(), last - first, max_depth, max_layers);
+	}
+	for (int j = first; j < last; ++j) {
+		color3d color;
+		if (wavefront) {
+			color = colors[j - first];
+		} else {
 			ray.direction = direction;
 			ray.direction.normalize();
-			color3d color = scene.trace(ray);
-			int alpha = color.a + 1;
-			row[0] = color.r * alpha >> 8;
-			row[1] = color.g * alpha >> 8;
-			row[2] = color.b * alpha >> 8;
-			row += 3;
+			if (tiles) {
+				const int tile = (i / tiles->size - tiles->first_row) * tiles->columns + j / tiles->size;
+				const int first = tiles->first[tile];
+				const int num = tiles->first[tile + 1] - first;
+				color = scene.trace(ray, tiles->handles.data() + first, num, max_depth, max_layers);
+			} else {
+				color = scene.trace(ray, max_depth, max_layers);
+			}
 			direction += dx;
 		}
+		int alpha = color.a + 1;
+		out[0] = color.r * alpha >> 8;
+		out[1] = color.g * alpha >> 8;
+		out[2] = color.b * alpha >> 8;
+		if (format == PIXEL_RGBA) {
+			out[3] = color.a;
+			out += 4;
+		} else {
+			out += 3;
+		}
 	}
+}
+
+bool camera3d::write_ppm(const char *path, const uint8_t *data) const {
 	std::ofstream fout(path, std::ios::out | std::ios::binary);
 	fout << "P6" << std::endl;
 	fout << width << ' ' << height << std::endl;
 	fout << 255 << std::endl;
-	fout.write((char*)data.get(), width * height * 3);
+	fout.write((const char*)data, (size_t)width * height * 3);
+	fout.close();
+	return !fout.fail();
+}
+
+// Renders several views of one scene as a single parallel job. Rows of all
+// views are interleaved in one dynamically scheduled loop, so threads that
+// finish one view keep working on the others instead of idling at its end.
+// Returns false if the scene is not prepared, then writing nothing, or if
+// any of the files could not be written.
+bool render_to_files(const scene3d &scene, const camera3d *cameras, const char * const *paths, int n) {
+	if (!scene.prepared())
+		return false;
+	std::vector<std::unique_ptr<uint8_t[]>> data(n);
+	std::vector<camera3d::tile_culling> tiles(n);
+	int max_height = 0;
+	for (int k = 0; k < n; ++k) {
+		data[k].reset(new uint8_t[(size_t)cameras[k].width * cameras[k].height * 3]);
+		max_height = std::max(max_height, cameras[k].height);
+		if (cameras[k].frustum_culling && !cameras[k].wavefront)
+			cameras[k].cull_tiles(scene, tiles[k]);
+	}
+	const int threads = cameras[0].threads();
+	const int chunk = cameras[0].chunk_rows * n;
+	#pragma omp parallel for schedule(dynamic, chunk) num_threads(threads)
+	for (int index = 0; index < max_height * n; ++index) {
+		const int i = index / n;
+		const int k = index % n;
+		const camera3d &camera = cameras[k];
+		const camera3d::tile_culling *culling = tiles[k].first.empty() ? nullptr : &tiles[k];
+		if (i < camera.height)
+			camera.render_row(scene, i, data[k].get() + (size_t)i * camera.width * 3, culling);
+	}
+	bool written = true;
+	for (int k = 0; k < n; ++k)
+		written = cameras[k].write_ppm(paths[k], data[k].get()) && written;
+	return written;
+}
+
+// Renders region of the camera's image into caller-owned memory of size
+// bytes. Pixel (x, y) of the region goes to out + y * stride + x * 3 (or 4
+// for RGBA); nothing of frame size is allocated. Color is premultiplied by
+// alpha as in the PPM output, RGBA also stores the alpha itself. Returns
+// false without writing anything if the scene is not prepared, the region
+// is not inside the image or the buffer is too small for it.
+//
+// With numa_placement, replicas can supply a copy of the scene for every
+// node, used by the threads running there.
+bool render(const scene3d &scene, const scene_replicas *replicas, const camera3d &camera, uint8_t *out, size_t size,
+	size_t stride, pixel_format format, const region2d &region)
+{
+	const size_t pixel_size = format == PIXEL_RGBA ? 4 : 3;
+	if (!scene.prepared() || (format != PIXEL_RGB && format != PIXEL_RGBA))
+		return false;
+	if (region.x < 0 || region.y < 0 || region.width < 0 || region.height < 0
+		|| region.width > camera.width - region.x || region.height > camera.height - region.y)
+		return false;
+	if (region.width == 0 || region.height == 0)
+		return true;
+	// Checked by division so that no product can overflow.
+	const size_t row_size = region.width * pixel_size;
+	if (!out || stride < row_size || size < row_size || (size - row_size) / stride < (size_t)region.height - 1)
+		return false;
+	camera3d::tile_culling tiles;
+	if (camera.frustum_culling && !camera.wavefront)
+		camera.cull_tiles(scene, tiles, &region);
+	const camera3d::tile_culling *culling = tiles.first.empty() ? nullptr : &tiles;
+	const int threads = camera.threads();
+#ifdef _OPENMP
+	if (camera.numa_placement) {
+		const numa_topology &topology = numa_topology::system();
+		const int nodes = topology.nodes();
+		// Bands of about a page, so that pages are rarely shared by nodes.
+		// Band b belongs to node b % nodes, each node hands its bands out to
+		// its own threads in order and then helps with those of the others.
+		const int band = (int)std::max<size_t>(1, (4096 + stride - 1) / stride);
+		const int num_bands = (region.height + band - 1) / band;
+		std::vector<std::atomic<int>> next(nodes);
+		for (auto &count : next)
+			count = 0;
+		#pragma omp parallel num_threads(threads)
+		{
+			int node;
+			const int cpu = topology.place(omp_get_thread_num(), omp_get_num_threads(), node);
+			pinned_thread pin(&cpu, 1);
+			const scene3d &local = replicas ? replicas->local(node) : scene;
+			for (int k = 0; k < nodes; ++k) {
+				const int queue = (node + k) % nodes;
+				for (;;) {
+					const int b = next[queue]++ * nodes + queue;
+					if (b >= num_bands)
+						break;
+					const int last = std::min(region.height, (b + 1) * band);
+					for (int r = b * band; r < last; ++r)
+						camera.render_span(local, region.y + r, region.x, region.x + region.width, out + r * stride, format, culling);
+				}
+			}
+		}
+		return true;
+	}
+#endif
+	#pragma omp parallel for schedule(dynamic, camera.chunk_rows) num_threads(threads)
+	for (int r = 0; r < region.height; ++r)
+		camera.render_span(scene, region.y + r, region.x, region.x + region.width, out + r * stride, format, culling);
+	return true;
+}
+
+bool render(const scene3d &scene, const camera3d &camera, uint8_t *out, size_t size, size_t stride,
+	pixel_format format, const region2d &region)
+{
+	return render(scene, nullptr, camera, out, size, stride, format, region);
+}
+
+bool render(const scene3d &scene, const camera3d &camera, uint8_t *out, size_t size, size_t stride, pixel_format format) {
+	return render(scene, nullptr, camera, out, size, stride, format, region2d{0, 0, camera.width, camera.height});
+}
+
+bool camera3d::render_to_file(const scene3d &scene, const char *path) {
+	const size_t size = (size_t)width * height * 3;
+	std::unique_ptr<uint8_t[]> data(new uint8_t[size]);
+	if (!render(scene, *this, data.get(), size, width * 3, PIXEL_RGB))
+		return false;
+	return write_ppm(path, data.get());
+}
+
+bool camera3d::render_to_file_streaming(const scene3d &scene, const char *path, int band_rows) const {
+	if (!scene.prepared() || band_rows <= 0)
+		return false;
+	const int threads = this->threads();
+	// Bands are handed out in order and a thread can not start a new band
+	// before its last one is written, so at most threads bands are in
+	// flight and a ring of twice as many buffers is never overrun.
+	const int ring = 2 * threads;
+	const size_t band_size = (size_t)band_rows * width * 3;
+	const int num_bands = (height + band_rows - 1) / band_rows;
+	std::unique_ptr<uint8_t[]> data(new uint8_t[ring * band_size]);
+	std::ofstream fout(path, std::ios::out | std::ios::binary);
+	fout << "P6" << std::endl;
+	fout << width << ' ' << height << std::endl;
+	fout << 255 << std::endl;
+	#pragma omp parallel num_threads(threads)
+	{
+		// Tiles are culled band by band, so culling memory is bounded by the
+		// band as well.
+		tile_culling tiles;
+		#pragma omp for schedule(dynamic) ordered
+		for (int band = 0; band < num_bands; ++band) {
+			uint8_t *buffer = data.get() + (band % ring) * band_size;
+			const int first = band * band_rows;
+			const int last = std::min(height, first + band_rows);
+			const tile_culling *culling = nullptr;
+			if (frustum_culling && !wavefront) {
+				const region2d region{0, first, width, last - first};
+				cull_tiles(scene, tiles, &region);
+				culling = &tiles;
+			}
+			for (int i = first; i < last; ++i)
+				render_row(scene, i, buffer + (size_t)(i - first) * width * 3, culling);
+			#pragma omp ordered
+			fout.write((const char*)buffer, (size_t)(last - first) * width * 3);
+		}
+	}
+	fout.close();
+	return !fout.fail();
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,122 @@
+#ifndef MIKES_CURVE_H_
+#define MIKES_CURVE_H_
+
+#include "object3d.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+vector3d getPointOnCurve(double t) {
+	double a = 14 * 3.1415926535897932384626433832795 * t;
+	double b = 2 * sqrt(t * (1 - t));
+	return vector3d(cos(a) * b, sin(a) * b, 1 - 2 * t);
+}
+
+double getAlphaNewthon(const vector3d &v) {
+	double t = (1 - v.z) * 0.5;
+	const double pi14 = 3.1415926535897932384626433832795 * 14;
+	const double pi142 = pi14 * pi14;
+	for (int k = 0; k < 8; ++k) {
+		const double a = pi14 * t;
+		const double bsq = t * (1 - t);
+		const double b = sqrt(bsq);
+		const double b2 = b * 2;
+		const double c = (2 - 4 * t) / b;
+		const double d = (2 * t * (1 - 2 * t) + 1) / (b * bsq);
+		const double sina = sin(a);
+		const double cosa = cos(a);
+		const double sina_b2 = sina * b2;
+		const double cosa_b2 = cosa * b2;
+		const double sina_c = sina * c;
+		const double cosa_c = cosa * c;
+		double f1 = v.x * (-pi14 * sina_b2 + cosa * c)
+		          + v.y * (+pi14 * cosa_b2 + sina * c)
+		          - 2 * v.z;
+		double f2 = v.x * (-pi142 * cosa_b2 - pi14 * sina_c + cosa * d)
+		          + v.y * (+pi142 * sina_b2 + pi14 * cosa_c + sina * d);
+		double deltaT = f1 / f2;
+		std::cerr << deltaT << ' ';
+		t -= deltaT;
+		if (t < 0)
+			t = 0;
+		else if (t > 1)
+			t = 1;
+	}
+	std::cerr << std::endl;
+	return t;
+}
+
+const float curveRadius = 1.0f / 10000;
+
+float distOnSphere(const vector3d &p, const vector3d &q) {
+	return 2 - 2 * dot_product(p, q);
+}
+
+float getAlphaStupid(const vector3d &v) {
+	const float a = (float)(14 * 3.1415926535897932384626433832795);
+	float t0 = (1 - v.z) * 0.5;
+	vector3d p0 = getPointOnCurve(t0);
+	float d0 = distOnSphere(p0, v);
+	// if (d0 > curveRadius * 1000)
+		// return -1;	
+	float t1 = std::max(t0 - curveRadius * 0.5f, 0.0f);
+	float t2 = std::min(t0 + curveRadius * 0.5f, 1.0f);
+	vector3d p1 = getPointOnCurve(t1);
+	vector3d p2 = getPointOnCurve(t2);
+	float d1 = distOnSphere(p1, v);
+	float d2 = distOnSphere(p2, v);
+	//std::cerr << dot_square(p2) << ' ' << d0 << ' ' << d1 << ' ' << d2 << std::endl;
+	return d1 <= d2
+		? t0 - ((d0 - d1) / distOnSphere(p0, p1) + 1) * 0.5f * (t1 - t0)
+		: t0 + ((d0 - d2) / distOnSphere(p0, p2) + 1) * 0.5f * (t2 - t0);
+}
+
+struct mikes_curve : object3d {
+	void box(vector3d &min, vector3d &max) {
+		min = vector3d(-1, -1, -1);
+		max = vector3d(1, 1, 1);
+	}
+	
+	float trace(const ray3d &ray, color3d &color, int &reflection, ray3d &reflected) {
+		float b = 0;
+		float c = -1;
+		for (int i = 0; i < 3; ++i) {
+			float d = ray.origin[i];
+			b += d * ray.direction[i];
+			c += d * d;
+		}
+		float d = b * b - c;
+		if (d <= 0)
+			return 0;
+		d = sqrtf(d);
+		float t = -b - d;
+		int sgn = 1;
+		for (int sgn = 1; sgn >= -1; sgn -= 2, t += 2 * d) {
+			if (t <= 0)
+				continue;
+			reflected.origin = ray.origin + ray.direction * t;
+			float alpha = getAlphaStupid(reflected.origin);
+			if (alpha < 0 || alpha > 1)
+				continue;
+			auto poc = getPointOnCurve(alpha);
+			float dist2 = dot_square(poc - reflected.origin);
+			if (dist2 > curveRadius)
+				continue;
+			auto radius_vector = (-reflected.origin) * sgn;
+			float ort = dot_product(ray.direction, radius_vector);
+			reflected.direction = ray.direction;
+			reflected.direction -= radius_vector * (ort * 2);
+			color.r = 255;
+			color.g = 255;
+			color.b = 255;
+			color.a = 255;
+			reflection = 0;
+			reflected.origin = reflected.origin;
+			return t * (1 - sgn * 0.001f);
+		}
+		return 0;
+	}
+};
+
+#endif
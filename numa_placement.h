@@ -0,0 +1,156 @@
+#ifndef NUMA_PLACEMENT_H_
+#define NUMA_PLACEMENT_H_
+
+#include "scene3d.h"
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include <algorithm>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// CPUs of each NUMA node that the process may run on, as listed in sysfs.
+// Without that information, and on systems other than Linux, all CPUs form
+// a single node.
+struct numa_topology {
+	std::vector<std::vector<int>> cpus;
+	
+	numa_topology();
+	
+	// Topology of the machine, read once.
+	static const numa_topology &system() {
+		static const numa_topology topology;
+		return topology;
+	}
+	
+	int nodes() const {
+		return (int)cpus.size();
+	}
+	
+	// CPU for thread out of threads and its node. Threads are spread over
+	// all CPUs in node order, so consecutive threads share a node and every
+	// node gets a share of the threads proportional to its CPUs.
+	int place(int thread, int threads, int &node) const;
+};
+
+numa_topology::numa_topology() {
+#ifdef __linux__
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+		for (int cpu = 0; cpu < (int)std::thread::hardware_concurrency(); ++cpu)
+			CPU_SET(cpu, &allowed);
+	for (int node = 0; ; ++node) {
+		std::ifstream fin("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+		if (!fin)
+			break;
+		// Ranges such as "0-15,32-47".
+		std::vector<int> list;
+		std::string range;
+		while (std::getline(fin, range, ',')) {
+			int first, last;
+			char dash;
+			std::istringstream in(range);
+			if (!(in >> first))
+				continue;
+			last = in >> dash >> last ? last : first;
+			for (int cpu = first; cpu <= last; ++cpu)
+				if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))
+					list.push_back(cpu);
+		}
+		if (!list.empty())
+			cpus.push_back(list);
+	}
+	if (cpus.empty()) {
+		cpus.resize(1);
+		for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+			if (CPU_ISSET(cpu, &allowed))
+				cpus[0].push_back(cpu);
+	}
+#endif
+	if (cpus.empty() || cpus[0].empty()) {
+		cpus.assign(1, std::vector<int>());
+		for (int cpu = 0; cpu < (int)std::max(1u, std::thread::hardware_concurrency()); ++cpu)
+			cpus[0].push_back(cpu);
+	}
+}
+
+int numa_topology::place(int thread, int threads, int &node) const {
+	int total = 0;
+	for (auto &list : cpus)
+		total += (int)list.size();
+	int index = (int)((long long)thread * total / threads);
+	for (node = 0; index >= (int)cpus[node].size(); ++node)
+		index -= (int)cpus[node].size();
+	return cpus[node][index];
+}
+
+// Restricts the calling thread to the given CPUs while in scope, does
+// nothing on systems other than Linux.
+class pinned_thread {
+public:
+#ifdef __linux__
+	pinned_thread(const int *cpus, int n) {
+		pinned = sched_getaffinity(0, sizeof(saved), &saved) == 0;
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (int k = 0; k < n; ++k)
+			CPU_SET(cpus[k], &set);
+		pinned = pinned && sched_setaffinity(0, sizeof(set), &set) == 0;
+	}
+	
+	~pinned_thread() {
+		if (pinned)
+			sched_setaffinity(0, sizeof(saved), &saved);
+	}
+#else
+	pinned_thread(const int*, int) {}
+#endif
+	
+	pinned_thread(const pinned_thread&) = delete;
+	pinned_thread &operator=(const pinned_thread&) = delete;
+	
+#ifdef __linux__
+private:
+	cpu_set_t saved;
+	bool pinned;
+#endif
+};
+
+// Copies of a prepared scene, one per node, each made by a thread running
+// on that node so that the tree and object lists are allocated in its local
+// memory. The objects themselves are shared by all copies. The replicas
+// are a snapshot: make them again after the scene is changed and prepared.
+class scene_replicas {
+public:
+	explicit scene_replicas(const scene3d &scene, const numa_topology &topology = numa_topology::system());
+	
+	const scene3d &local(int node) const {
+		return *copies[node];
+	}
+	
+private:
+	std::vector<std::unique_ptr<scene3d>> copies;
+};
+
+scene_replicas::scene_replicas(const scene3d &scene, const numa_topology &topology)
+	: copies(topology.nodes())
+{
+	assert(scene.prepared());
+	std::vector<std::thread> threads;
+	for (int node = 0; node < topology.nodes(); ++node)
+		threads.emplace_back([&, node] {
+			pinned_thread pin(topology.cpus[node].data(), (int)topology.cpus[node].size());
+			copies[node].reset(new scene3d(scene));
+		});
+	for (auto &thread : threads)
+		thread.join();
+}
+
+#endif
@@ -17,6 +17,13 @@ struct object3d {
 		max.y = +std::numeric_limits<float>::max();
 		max.z = +std::numeric_limits<float>::max();
 	}
+	
+	// Coarse stand-in for the object once it covers less than a ray
+	// footprint: a sphere bounding it and the color the object averages to
+	// over it. Objects without one are always traced.
+	virtual bool impostor(vector3d &center, float &radius, color3d &color) {
+		return false;
+	}
 };
 
 #endif
\ No newline at end of file
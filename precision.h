@@ -0,0 +1,48 @@
+#ifndef PRECISION_H_
+#define PRECISION_H_
+
+#include <cmath>
+
+#if defined(__SSE__) || defined(_M_X64)
+#include <xmmintrin.h>
+#endif
+
+// Fast path: float arithmetic throughout, reciprocal square root estimate
+// refined with one Newton step (about 22 correct bits).
+struct float_precision {
+	typedef float scalar;
+	
+	static float sqrt(float x) {
+		return sqrtf(x);
+	}
+	
+	static float rsqrt(float x) {
+#if defined(__SSE__) || defined(_M_X64)
+		float y = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(x)));
+		return y * (1.5f - 0.5f * x * y * y);
+#else
+		return 1.0f / sqrtf(x);
+#endif
+	}
+};
+
+// Reference path: double storage and exact library functions.
+struct double_precision {
+	typedef double scalar;
+	
+	static double sqrt(double x) {
+		return std::sqrt(x);
+	}
+	
+	static double rsqrt(double x) {
+		return 1.0 / std::sqrt(x);
+	}
+};
+
+#ifdef RAYTRACER_DOUBLE_PRECISION
+typedef double_precision default_precision;
+#else
+typedef float_precision default_precision;
+#endif
+
+#endif
@@ -1,75 +1,84 @@
 #ifndef QUATERNION_H_
-#defien QUATERNION_H_
+#define QUATERNION_H_
 
 #include <cmath>
 
+#include "precision.h"
 #include "vector3d.h"
 
-struct alignas(16) quaternion {
-	float x;
-	float y;
-	float z;
-	float w;
+template <class Precision>
+struct alignas(16) basic_quaternion {
+	typedef typename Precision::scalar scalar;
 	
-	quaternion(float x = 0, float y = 0, float z = 0, float w = 0)
+	scalar x;
+	scalar y;
+	scalar z;
+	scalar w;
+	
+	basic_quaternion(scalar x = 0, scalar y = 0, scalar z = 0, scalar w = 0)
 		: x(x)
 		, y(y)
 		, z(z)
 		, w(w)
 	{}
 
-	quaternion(const vector3d &v, double theta) {
-		theta *= 0.5;
-		double s = sin(theta);
-		x = (float)(v.x * s);
-		y = (float)(v.y * s);
-		z = (float)(v.z * s);
-		w = (float)cos(theta);
+	basic_quaternion(const basic_vector3d<Precision> &v, scalar theta) {
+		theta *= (scalar)0.5;
+		scalar s = std::sin(theta);
+		x = v.x * s;
+		y = v.y * s;
+		z = v.z * s;
+		w = std::cos(theta);
 	}
 	
 	void normalize() {
-		double s = sqrt(1.0 / ((double)x * x + (double)y * y + (double)z * z + (double)w * w));
-		x = (float)(x * s);
-		y = (float)(y * s);
-		z = (float)(z * s);
+		scalar s = Precision::rsqrt(x * x + y * y + z * z + w * w);
+		x *= s;
+		y *= s;
+		z *= s;
+		w *= s;
 	}
 };
 
-quaternion& operator += (quaternioin &a, const quaternion &b) {
+typedef basic_quaternion<default_precision> quaternion;
+
+template <class P>
+basic_quaternion<P>& operator += (basic_quaternion<P> &a, const basic_quaternion<P> &b) {
 	a.x += b.x;
 	a.y += b.y;
 	a.z += b.z;
 	a.w += b.w;
+	return a;
 }
 
-quaternion& operator -= (quaternioin &a, const quaternion &b) {
+template <class P>
+basic_quaternion<P>& operator -= (basic_quaternion<P> &a, const basic_quaternion<P> &b) {
 	a.x -= b.x;
 	a.y -= b.y;
 	a.z -= b.z;
 	a.w -= b.w;
+	return a;
 }
 
-quaternion operator * (const quaternion &a, const quaternion &b) {
-	return quaternion {
+template <class P>
+basic_quaternion<P> operator * (const basic_quaternion<P> &a, const basic_quaternion<P> &b) {
+	return basic_quaternion<P> {
 		a.w * b.x + a.x * b.w + a.y * b.z - a.z * b.y,
-		a.w * b.y + a.y * b.w + a.y * b.z - a.z * b.y,
-		a.w * b.z + a.z * b.w - a.x * b.z + a.z * b.x,
+		a.w * b.y - a.x * b.z + a.y * b.w + a.z * b.x,
+		a.w * b.z + a.x * b.y - a.y * b.x + a.z * b.w,
 		a.w * b.w - a.x * b.x - a.y * b.y - a.z * b.z
 	};
 }
 
-quaternion conj(const quaternion &a) {
-	return quaternion { -a.x, -a.y, -a.z, a.w };
+template <class P>
+basic_quaternion<P> conj(const basic_quaternion<P> &a) {
+	return basic_quaternion<P> { -a.x, -a.y, -a.z, a.w };
 }
 
-quaternion inverse(const quaternion &a) {
-	double s = 1.0 / ((double)a.x * a.x + (double)a.y * a.y + (double)a.z * a.z + (double)a.w * a.w);
-	return quaternion { 
-		(float)(-a.x * s),
-		(float)(-a.y * s),
-		(float)(-a.z * s),
-		(float)( a.w * s)
-	};
+template <class P>
+basic_quaternion<P> inverse(const basic_quaternion<P> &a) {
+	typename P::scalar s = 1 / (a.x * a.x + a.y * a.y + a.z * a.z + a.w * a.w);
+	return basic_quaternion<P> { -a.x * s, -a.y * s, -a.z * s, a.w * s };
 }
 
-#endif
\ No newline at end of file
+#endif
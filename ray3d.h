@@ -6,6 +6,10 @@
 struct ray3d {
 	vector3d origin;
 	vector3d direction;
+	// Width of the pixel footprint at the origin and its growth per unit of
+	// distance, used by shaders to band-limit procedural textures.
+	float width = 0;
+	float spread = 0;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,167 @@
+#ifndef REFERENCE_SCENES_H_
+#define REFERENCE_SCENES_H_
+
+#include "camera3d.h"
+#include "mikes_curve.h"
+#include "scene3d.h"
+#include "shapes3d.h"
+
+#include <cmath>
+#include <memory>
+
+// Two mirror chessboards around a painted sphere (renderer.cpp).
+const int MIRROR_FRAMES = 300;
+
+void build_mirror_scene(scene3d &scene) {
+	auto floor = std::make_shared<infinite_chessboard>(-10, 1.0 / 2);
+	floor->mirror = 191;
+	scene.add(floor);
+	auto ceiling = std::make_shared<infinite_chessboard>(10, 2);
+	ceiling->mirror = 191;
+	scene.add(ceiling);
+	auto sphere = std::make_shared<painted_sphere3d>();
+	sphere->radius = 20;
+	sphere->color = color3d{0, 0, 255, 127};
+	sphere->mirror = 127;
+	scene.add(sphere);
+	//scene.add(std::make_shared<infinite_chessboard>(-20));
+	//scene.add(std::make_shared<infinite_chessboard>(20));
+	scene.prepare();
+}
+
+void mirror_camera(camera3d &camera, int frame) {
+	const int n = MIRROR_FRAMES;
+	const int r0 = 10;
+	const int r1 = 30;
+	const double pi = acos(-1.0);
+	double angle = frame * 4 * (pi / n);
+	camera.origin = vector3d(r0 * cos(angle), sin(angle / 2) * sqrt(angle) * 9, r1 * sin(angle));
+	camera.look_at(vector3d());
+}
+
+// Mike's curve on a translucent sphere with marker spheres (taskFromMike_v2.cpp).
+const int MIKE_FRAMES = 3 * 180;
+
+vector3d getPointOnCurveOld(double alpha) {
+	double a = alpha * 3.1415926535897932384626433832795 * 7 / 6;
+	double b = 2 * sqrt(alpha * (1 - alpha));
+	return vector3d(cos(a) * b, sin(a) * b, 1 - 2 * alpha);
+}
+
+void build_mike_scene(scene3d &scene) {
+	auto floor = std::make_shared<infinite_chessboard>(-10, 1.0 / 2);
+	floor->opacity = 64;
+	scene.add(floor);
+	auto sphere = std::make_shared<sphere3d>();
+	sphere->radius = 1;
+	sphere->color = color3d{0, 255, 255, 223};
+	sphere->mirror = 0;
+	scene.add(sphere);
+	scene.add(std::make_shared<mikes_curve>());
+	// sphere = std::make_shared<sphere3d>();
+	// sphere->radius = 50;
+	// sphere->color = color3d{255, 0, 255, 127};
+	// sphere->center = vector3d(0, -10, 0);
+	// sphere->mirror = 0;
+	// scene.add(sphere);
+	scene.add(std::make_shared<mikes_curve>());
+	for (int i = 0; i <= 12; ++i) {
+		sphere = std::make_shared<sphere3d>();
+		sphere->radius = 0.02;
+		sphere->color = color3d{0, 0, 255, 255};
+		sphere->center = getPointOnCurve(i * (1.0 / 12));
+		sphere->mirror = 0;
+		scene.add(sphere);
+	}
+	//scene.add(std::make_shared<infinite_chessboard>(-20));
+	//scene.add(std::make_shared<infinite_chessboard>(20));
+	scene.prepare();
+}
+
+void mike_camera(camera3d &camera, int frame) {
+	const int n = MIKE_FRAMES / 3;
+	const double rs[] = {1.66, 1.66, -0.9};
+	const double pi = acos(-1.0);
+	const int i = frame % n;
+	const int j = frame / n;
+	auto point = getPointOnCurveOld(i * (1.0 / n));
+	if (j == 0) {
+		double angle = 2 * pi * i / n;
+		camera.origin = vector3d(sin(angle) * rs[j], 0, cos(angle) * rs[j]);
+		camera.look_at(vector3d());
+	} else {
+		camera.origin = point * rs[j];
+		camera.look_at(point);
+	}
+}
+
+// A mirror sphere inside a cloud of small spheres, mostly narrower than a
+// pixel, a third of them translucent and some of them mirrors, that is
+// partly moved and thinned out from frame to frame. It covers the tree,
+// frustum culling, impostors and incremental updates.
+const int DENSE_FRAMES = 240;
+const int DENSE_SPHERES = 20000;
+
+// Deterministic on every platform, unlike rand().
+unsigned dense_random(unsigned &state) {
+	state = state * 1664525 + 1013904223;
+	return state >> 8;
+}
+
+vector3d dense_position(unsigned &state) {
+	for (;;) {
+		vector3d point(dense_random(state) % 6001 / 100.0 - 30, dense_random(state) % 6001 / 100.0 - 30,
+			dense_random(state) % 6001 / 100.0 - 30);
+		const double r = abs(point);
+		if (r >= 4 && r <= 30)
+			return point;
+	}
+}
+
+void build_dense_scene(scene3d &scene) {
+	auto mirror = std::make_shared<sphere3d>();
+	mirror->radius = 2;
+	mirror->color = color3d{255, 255, 255, 255};
+	mirror->mirror = 191;
+	scene.add(mirror);
+	unsigned state = 1;
+	for (int k = 0; k < DENSE_SPHERES; ++k) {
+		auto sphere = std::make_shared<sphere3d>();
+		sphere->center = dense_position(state);
+		sphere->radius = 0.04;
+		sphere->color = color3d{(uint8_t)(dense_random(state) % 256), (uint8_t)(dense_random(state) % 256),
+			(uint8_t)(dense_random(state) % 256), (uint8_t)(k % 3 == 0 ? 110 : 255)};
+		sphere->mirror = k % 17 == 0 ? 127 : 0;
+		scene.add(sphere);
+	}
+	scene.prepare();
+}
+
+// Moves every 37th sphere along a circle and removes a few more, in place
+// of what the frame before left.
+void animate_dense_scene(scene3d &scene, int frame) {
+	const double pi = acos(-1.0);
+	for (scene3d::handle id = 1; id <= DENSE_SPHERES; ++id) {
+		auto sphere = std::dynamic_pointer_cast<sphere3d>(scene.get(id));
+		if (!sphere)
+			continue;
+		if (id % 101 == frame % 101) {
+			scene.remove(id);
+		} else if (id % 37 == 0) {
+			const double angle = 2 * pi * (frame + id) / DENSE_FRAMES;
+			const double r = 4 + id % 26;
+			sphere->center = vector3d(r * cos(angle), id % 13 - 6.0, r * sin(angle));
+			scene.update(id);
+		}
+	}
+	scene.prepare();
+}
+
+void dense_camera(camera3d &camera, int frame) {
+	const double pi = acos(-1.0);
+	const double angle = 2 * pi * frame / DENSE_FRAMES;
+	camera.origin = vector3d(12 * cos(angle), 3 * sin(2 * angle), 12 * sin(angle));
+	camera.look_at(vector3d());
+}
+
+#endif
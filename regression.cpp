@@ -0,0 +1,214 @@
+#include "autotune.h"
+#include "camera3d.h"
+#include "reference_scenes.h"
+
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+// Fixed scenes and frames whose output and timing are tracked between builds.
+struct regression_case {
+	const char *name;
+	void (*build)(scene3d &scene);
+	void (*place)(camera3d &camera, int frame);
+	// Changes the scene before a frame and prepares it, may be null.
+	void (*animate)(scene3d &scene, int frame);
+	std::vector<int> frames;
+};
+
+struct ppm_image {
+	int width;
+	int height;
+	std::vector<uint8_t> data;
+};
+
+bool read_ppm(const std::string &path, ppm_image &image) {
+	std::ifstream fin(path, std::ios::in | std::ios::binary);
+	std::string magic;
+	int max_value = 0;
+	fin >> magic >> image.width >> image.height >> max_value;
+	if (!fin || magic != "P6" || max_value != 255)
+		return false;
+	fin.get();
+	image.data.resize((size_t)image.width * image.height * 3);
+	fin.read((char*)image.data.data(), image.data.size());
+	return (bool)fin;
+}
+
+// Peak resident size of the whole process so far, not of a single frame.
+long peak_memory_kb() {
+	rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss;
+}
+
+int main(int argc, char **argv) {
+	std::string dir = "regression";
+	bool update = false;
+	bool record_baseline = false;
+	int width = 320;
+	int height = 180;
+	int repeat = 3;
+	bool wavefront = false;
+	bool numa = false;
+	int band_rows = 0;
+	bool tune = false;
+	int tolerance = 8;
+	double outliers = 0;
+	double slowdown = 0.1;
+	for (int i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "--update")) {
+			update = true;
+		} else if (!strcmp(argv[i], "--baseline")) {
+			record_baseline = true;
+		} else if (!strcmp(argv[i], "--autotune")) {
+			tune = true;
+		} else if (!strcmp(argv[i], "--wavefront")) {
+			wavefront = true;
+		} else if (!strcmp(argv[i], "--numa")) {
+			numa = true;
+		} else if (!strcmp(argv[i], "--streaming") && i + 1 < argc) {
+			band_rows = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--dir") && i + 1 < argc) {
+			dir = argv[++i];
+		} else if (!strcmp(argv[i], "--size") && i + 1 < argc) {
+			sscanf(argv[++i], "%dx%d", &width, &height);
+		} else if (!strcmp(argv[i], "--repeat") && i + 1 < argc) {
+			repeat = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--tolerance") && i + 1 < argc) {
+			tolerance = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--outliers") && i + 1 < argc) {
+			outliers = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "--slowdown") && i + 1 < argc) {
+			slowdown = atof(argv[++i]);
+		} else {
+			std::cerr << "usage: " << argv[0] << " [--update] [--baseline] [--autotune] [--wavefront] [--numa] [--streaming band_rows] [--dir path] [--size WxH] [--repeat n]"
+			          << " [--tolerance levels] [--outliers fraction] [--slowdown fraction]" << std::endl;
+			return 2;
+		}
+	}
+	const regression_case cases[] = {
+		{ "mirror", build_mirror_scene, mirror_camera, nullptr, { 0, 75, 150, 225 } },
+		{ "mike", build_mike_scene, mike_camera, nullptr, { 0, 90, 200, 300, 450 } },
+		{ "dense", build_dense_scene, dense_camera, animate_dense_scene, { 0, 40, 80, 120, 160, 200 } },
+	};
+	// References are shared, timings only compare on the machine that made them.
+	char host[256] = "unknown";
+	gethostname(host, sizeof(host) - 1);
+#ifdef RAYTRACER_DOUBLE_PRECISION
+	const std::string baseline_path = dir + "/baseline_" + host + "_double.txt";
+#else
+	const std::string baseline_path = dir + "/baseline_" + host + ".txt";
+#endif
+	std::map<std::string, double> baseline;
+	{
+		std::ifstream fin(baseline_path);
+		std::string key;
+		double seconds;
+		while (fin >> key >> seconds)
+			baseline[key] = seconds;
+	}
+	// The double precision build renders slightly different images, so it
+	// keeps references of its own.
+#ifdef RAYTRACER_DOUBLE_PRECISION
+	const std::string reference_dir = dir + "/reference_double";
+#else
+	const std::string reference_dir = dir + "/reference";
+#endif
+	mkdir(dir.c_str(), 0755);
+	mkdir(reference_dir.c_str(), 0755);
+	mkdir((dir + "/current").c_str(), 0755);
+	std::ofstream baseline_out;
+	if (update || record_baseline)
+		baseline_out.open(baseline_path);
+	int failures = 0;
+	for (auto &test : cases) {
+		scene3d scene;
+		test.build(scene);
+		camera3d camera;
+		camera.fov = 130;
+		camera.width = width;
+		camera.height = height;
+		camera.wavefront = wavefront;
+		camera.numa_placement = numa;
+		for (int frame : test.frames) {
+			char key[256];
+			sprintf(key, "%s_%04d_%dx%d", test.name, frame, width, height);
+			const std::string reference_path = reference_dir + "/" + key + ".ppm";
+			const std::string current_path = dir + "/current/" + key + ".ppm";
+			if (test.animate)
+				test.animate(scene, frame);
+			test.place(camera, frame);
+			if (tune) {
+				auto config = autotune(scene, camera, (dir + "/autotune.txt").c_str());
+				std::cout << key << ": " << config.num_threads << " threads, " << config.tile_size << " px tiles, "
+				          << config.chunk_rows << " rows per chunk" << (config.wavefront ? ", wavefront" : "")
+				          << (config.frustum_culling ? ", culling" : "") << std::endl;
+			}
+			double seconds = 0;
+			for (int k = 0; k < repeat; ++k) {
+				auto start = std::chrono::steady_clock::now();
+				if (band_rows > 0)
+					camera.render_to_file_streaming(scene, current_path.c_str(), band_rows);
+				else
+					camera.render_to_file(scene, current_path.c_str());
+				std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+				if (k == 0 || elapsed.count() < seconds)
+					seconds = elapsed.count();
+			}
+			std::cout << key << ": " << seconds * 1000 << " ms, "
+			          << width * height / seconds * 1e-6 << " Mrays/s (primary), "
+			          << peak_memory_kb() / 1024 << " MB process peak";
+			if (baseline_out.is_open())
+				baseline_out << key << ' ' << seconds << std::endl;
+			if (update) {
+				std::rename(current_path.c_str(), reference_path.c_str());
+				std::cout << ", updated" << std::endl;
+				continue;
+			}
+			ppm_image expected, actual;
+			if (!read_ppm(reference_path, expected) || !read_ppm(current_path, actual)) {
+				std::cout << ", NO REFERENCE" << std::endl;
+				++failures;
+				continue;
+			}
+			int max_diff = 0;
+			size_t num_diff = 0;
+			size_t num_outliers = 0;
+			for (size_t i = 0; i < expected.data.size() && i < actual.data.size(); ++i) {
+				int diff = abs(expected.data[i] - actual.data[i]);
+				max_diff = std::max(max_diff, diff);
+				num_diff += diff != 0;
+				num_outliers += diff > tolerance;
+			}
+			if (expected.data.size() != actual.data.size() || num_outliers > outliers * expected.data.size()) {
+				std::cout << ", IMAGE MISMATCH (max diff " << max_diff << ", "
+				          << num_outliers << " of " << num_diff << " differing channels over tolerance)";
+				++failures;
+			}
+			auto base = baseline.find(key);
+			if (base != baseline.end()) {
+				double ratio = seconds / base->second;
+				std::cout << ", " << (ratio - 1) * 100 << "% vs baseline";
+				if (ratio > 1 + slowdown) {
+					std::cout << ", SLOWDOWN";
+					++failures;
+				}
+			}
+			std::cout << std::endl;
+		}
+	}
+	if (failures != 0)
+		std::cout << failures << " regression(s)" << std::endl;
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,232 @@
+#include "camera3d.h"
+#include "reference_scenes.h"
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Largest image a job may ask for, frames are held in memory while rendered.
+const long MAX_PIXELS = 1L << 26;
+
+// Long-running renderer serving jobs over a Unix socket. Scenes are built and
+// prepared once at startup and shared by all jobs; a fixed set of workers runs
+// jobs concurrently, each with its own team of cores / workers threads, so the
+// machine is never oversubscribed.
+//
+// Protocol, one command per line:
+//   render <scene> <x> <y> <z> <target x> <target y> <target z> <fov> <width> <height> <file>
+//     -> ok <job> <queue ms> <render ms> | error <message>
+// where file is a plain file name written to the output directory.
+//   stats
+//     -> queued <n> running <n> done <n> avg_latency_ms <t> max_latency_ms <t>
+typedef std::chrono::steady_clock clock_type;
+
+struct render_job {
+	const scene3d *scene;
+	camera3d camera;
+	std::string path;
+	clock_type::time_point queued;
+	bool done;
+	std::string reply;
+};
+
+class render_daemon {
+public:
+	render_daemon(int num_workers, int num_cores, const std::string &output_dir)
+		: output_dir(output_dir)
+		, threads_per_job(std::max(1, num_cores / num_workers))
+		, running(0)
+		, completed(0)
+		, next_id(0)
+		, total_latency(0)
+		, max_latency(0)
+	{
+		for (int i = 0; i < num_workers; ++i)
+			workers.emplace_back(&render_daemon::work, this);
+	}
+	
+	void add_scene(const std::string &name, void (*build)(scene3d &scene)) {
+		std::unique_ptr<scene3d> scene(new scene3d());
+		build(*scene);
+		scene->prepare();
+		scenes[name] = std::move(scene);
+	}
+	
+	std::string execute(const std::string &line);
+	
+private:
+	std::string output_dir;
+	int threads_per_job;
+	std::map<std::string, std::unique_ptr<scene3d>> scenes;
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable job_queued;
+	std::condition_variable job_done;
+	std::deque<render_job*> queue;
+	int running;
+	long completed;
+	long next_id;
+	double total_latency;
+	double max_latency;
+	
+	static double ms(clock_type::duration d) {
+		return std::chrono::duration<double, std::milli>(d).count();
+	}
+	
+	void work();
+};
+
+void render_daemon::work() {
+	for (;;) {
+		render_job *job;
+		long id;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			job_queued.wait(lock, [this] { return !queue.empty(); });
+			job = queue.front();
+			queue.pop_front();
+			id = next_id++;
+			++running;
+			job->camera.num_threads = threads_per_job;
+		}
+		const auto start = clock_type::now();
+		std::ostringstream reply;
+		try {
+			if (!job->camera.render_to_file(*job->scene, job->path.c_str()))
+				reply << "error can not render or write output";
+			else
+				reply << "ok " << id << ' ' << ms(start - job->queued) << ' ' << ms(clock_type::now() - start);
+		} catch (const std::bad_alloc&) {
+			reply << "error out of memory";
+		}
+		const auto finish = clock_type::now();
+		std::lock_guard<std::mutex> lock(mutex);
+		--running;
+		++completed;
+		const double latency = ms(finish - job->queued);
+		total_latency += latency;
+		max_latency = std::max(max_latency, latency);
+		job->reply = reply.str();
+		job->done = true;
+		job_done.notify_all();
+	}
+}
+
+std::string render_daemon::execute(const std::string &line) {
+	std::istringstream in(line);
+	std::string command;
+	in >> command;
+	if (command == "stats") {
+		std::lock_guard<std::mutex> lock(mutex);
+		std::ostringstream out;
+		out << "queued " << queue.size() << " running " << running << " done " << completed
+		    << " avg_latency_ms " << (completed ? total_latency / completed : 0)
+		    << " max_latency_ms " << max_latency;
+		return out.str();
+	}
+	if (command != "render")
+		return "error unknown command";
+	std::string name;
+	float x, y, z, tx, ty, tz;
+	render_job job;
+	if (!(in >> name >> x >> y >> z >> tx >> ty >> tz >> job.camera.fov >> job.camera.width >> job.camera.height >> job.path))
+		return "error malformed render command";
+	if (job.path.empty() || job.path == "." || job.path == ".." || job.path.find('/') != std::string::npos)
+		return "error output must be a file name";
+	job.path = output_dir + "/" + job.path;
+	auto scene = scenes.find(name);
+	if (scene == scenes.end())
+		return "error unknown scene " + name;
+	if (job.camera.width <= 0 || job.camera.height <= 0 || (long)job.camera.width * job.camera.height > MAX_PIXELS)
+		return "error bad resolution";
+	for (float value : {x, y, z, tx, ty, tz, job.camera.fov}) {
+		if (!std::isfinite(value))
+			return "error non-finite camera parameter";
+	}
+	// look_at() keeps the image upright around the y axis, so it needs a
+	// view direction that is neither zero nor vertical.
+	const float dx = tx - x, dy = ty - y, dz = tz - z;
+	if (dx * dx + dz * dz <= 1e-6f * (dx * dx + dy * dy + dz * dz))
+		return "error view direction is zero or vertical";
+	job.scene = scene->second.get();
+	job.camera.origin = vector3d(x, y, z);
+	job.camera.look_at(vector3d(tx, ty, tz));
+	job.queued = clock_type::now();
+	job.done = false;
+	std::unique_lock<std::mutex> lock(mutex);
+	queue.push_back(&job);
+	job_queued.notify_one();
+	job_done.wait(lock, [&job] { return job.done; });
+	return job.reply;
+}
+
+void serve(render_daemon &daemon, int fd) {
+	std::string buffer;
+	char chunk[4096];
+	for (;;) {
+		ssize_t size = recv(fd, chunk, sizeof(chunk), 0);
+		if (size <= 0)
+			break;
+		buffer.append(chunk, size);
+		size_t end;
+		while ((end = buffer.find('\n')) != std::string::npos) {
+			std::string reply = daemon.execute(buffer.substr(0, end)) + "\n";
+			buffer.erase(0, end + 1);
+			if (send(fd, reply.data(), reply.size(), MSG_NOSIGNAL) < 0)
+				break;
+		}
+	}
+	close(fd);
+}
+
+int main(int argc, char **argv) {
+	const char *path = argc > 1 ? argv[1] : "/tmp/toy-ray-tracer.sock";
+	const int num_cores = (int)std::max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+	const int num_workers = argc > 2 ? atoi(argv[2]) : std::min(num_cores, 4);
+	const std::string output_dir = argc > 3 ? argv[3] : "renders";
+	mkdir(output_dir.c_str(), 0755);
+	render_daemon daemon(std::max(1, num_workers), num_cores, output_dir);
+	daemon.add_scene("mirror", build_mirror_scene);
+	daemon.add_scene("mike", build_mike_scene);
+	signal(SIGPIPE, SIG_IGN);
+	int server = socket(AF_UNIX, SOCK_STREAM, 0);
+	sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+	unlink(path);
+	// Only the daemon's user may connect and have files written in its name.
+	const mode_t mask = umask(0077);
+	const bool bound = server >= 0 && bind(server, (sockaddr*)&address, sizeof(address)) == 0;
+	umask(mask);
+	if (!bound || chmod(path, 0600) < 0 || listen(server, 64) < 0) {
+		perror(path);
+		return 1;
+	}
+	std::cout << "listening on " << path << std::endl;
+	for (;;) {
+		int fd = accept(server, nullptr, nullptr);
+		if (fd < 0)
+			continue;
+		std::thread(serve, std::ref(daemon), fd).detach();
+	}
+	return 0;
+}
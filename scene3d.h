@@ -4,79 +4,905 @@
 #include "object3d.h"
 
 #include <algorithm>
+#include <cassert>
+#include <functional>
+#include <limits>
 #include <utility>
 #include <memory>
+#include <string>
+#include <typeinfo>
+#include <unordered_map>
 #include <vector>
 
 class scene3d {
 public:
 	typedef std::shared_ptr<object3d> object3d_ptr;
+	// Stable id of an object, valid until the object is removed.
+	typedef int handle;
 	
-	void add(object3d_ptr obj) {
-		objects.push_back(obj);
+	scene3d() : num_removed(0), stale_impostors(false), detail(1) {}
+	
+	handle add(object3d_ptr obj);
+	void remove(handle id);
+	void remove(object3d_ptr obj);
+	// Marks an object whose geometry has changed.
+	void update(handle id);
+	
+	object3d_ptr get(handle id) const {
+		return slots[id].object;
+	}
+	
+	// Brings the acceleration structure up to date after add, remove and
+	// update. Moved objects are refitted in place, subtrees whose bounds
+	// degraded too much are rebuilt, and the whole tree is rebuilt only once
+	// many objects were added or removed. Call once per frame before tracing.
+	void prepare();
+	
+	// Objects removed from the tree also leave the merged impostors stale.
+	// They are not kept up to date while level of detail is off.
+	bool prepared() const {
+		return dirty.empty() && stale_leaves.empty() && (!stale_impostors || detail <= 0);
+	}
+	
+	// Hash of the scene layout, the types and bounds of its objects.
+	size_t hash() const;
+	
+	// Objects and subtrees narrower than footprints times the footprint of
+	// a ray at their distance are drawn as their impostors, averaged color
+	// spread over the footprint with alpha for the fraction they cover.
+	// Subtrees are merged only when all their objects have impostors, so
+	// per-ray cost stays bounded in dense far away geometry. 0 traces every
+	// object in full and skips merging, turning it back on after the scene
+	// changed needs another prepare().
+	void set_level_of_detail(float footprints) {
+		detail = footprints;
+	}
+	
+	// Largest supported number of composited layers per ray, max_layers
+	// outside 1..MAX_LAYERS is clamped to that range.
+	static const int MAX_LAYERS = 16;
+	// Contribution weights are fixed point with 16 fractional bits.
+	static const int FULL_WEIGHT = 1 << 16;
+	// Reflections weighted below one 8-bit quantization step are cut off
+	// the same way as at max_depth.
+	static const int MIN_WEIGHT = 1 << 8;
+	
+	color3d trace(const ray3d &ray, int max_depth = 4, int max_layers = 8, int weight = FULL_WEIGHT) const;
+	
+	// Traces a batch of rays breadth first with the same result as trace().
+	// Every depth level is intersected as a whole and the reflected rays it
+	// emits are sorted by direction before the next level, so bounce rays of
+	// neighbouring pixels are processed together and in coherent order.
+	void trace_wavefront(const ray3d *rays, color3d *colors, int n, int max_depth = 4, int max_layers = 8) const;
+	
+	// Traces a ray that can only hit the given candidates, as returned by
+	// cull(). Reflected rays are traced against the whole scene.
+	color3d trace(const ray3d &ray, const handle *candidates, int num_candidates, int max_depth = 4, int max_layers = 8) const;
+	
+	// Appends the objects whose bounds are not entirely behind one of the
+	// planes through origin, so that n * (x - origin) >= 0 for all normals n.
+	// Leaves, subtrees entirely in front of the planes and, given the spread
+	// of the rays to be traced, subtrees drawn as their impostor at their
+	// distance are appended as a whole, as -1 - the index of their node.
+	void cull(const vector3d &origin, const vector3d *normals, int num_planes, std::vector<handle> &out,
+		float spread = 0) const;
+private:
+	struct layer3d {
+		float t;
+		color3d color;
+		int reflection;
+		ray3d reflected;
+	};
+	
+	// Stand-in for an object or a subtree, radius is negative if there is none.
+	struct impostor3d {
+		vector3d center;
+		float radius;
+		color3d color;
+		// Some object of the subtree has an impostor, so rays passing within
+		// a footprint of its box may hit it.
+		bool reach;
+	};
+	
+	struct slot3d {
+		object3d_ptr object;
+		vector3d min;
+		vector3d max;
+		// Leaf of the tree holding the object, -1 if it is traced linearly.
+		int leaf;
+		// Index in pending or unbounded while leaf is -1.
+		int position;
+		bool dirty;
+		impostor3d impostor;
+	};
+	
+	// Node of a bounding volume hierarchy stored in depth first order: the
+	// left child follows its parent, right is -1 for leaves.
+	struct node3d {
+		vector3d min;
+		vector3d max;
+		float built_area;
+		int parent;
+		int right;
+		int first;
+		int count;
+	};
+	
+	static const int LEAF_SIZE = 4;
+	
+	std::vector<slot3d> slots;
+	std::vector<handle> free_handles;
+	std::vector<handle> released;
+	std::unordered_map<object3d*, handle> handles;
+	std::vector<node3d> nodes;
+	// Aggregate impostor of each node.
+	std::vector<impostor3d> impostors;
+	// Objects in leaf order, removed ones stay until the next rebuild.
+	std::vector<handle> items;
+	std::vector<handle> unbounded;
+	// Bounded objects added since the last rebuild, traced linearly.
+	std::vector<handle> pending;
+	std::vector<handle> dirty;
+	int num_removed;
+	// Leaves that lost objects since the last prepare().
+	std::vector<int> stale_leaves;
+	// Merged impostors of the whole tree are out of date.
+	bool stale_impostors;
+	float detail;
+	
+	static bool less(const layer3d &lhs, const layer3d &rhs) {
+		return lhs.t < rhs.t;
+	}
+	
+	static bool is_bounded(const vector3d &min, const vector3d &max) {
+		for (int i = 0; i < 3; ++i) {
+			if (min[i] == -std::numeric_limits<float>::max() || max[i] == std::numeric_limits<float>::max())
+				return false;
+		}
+		return true;
+	}
+	
+	static float area(const vector3d &min, const vector3d &max) {
+		if (min.x > max.x)
+			return 0;
+		vector3d d = max - min;
+		return d.x * d.y + d.y * d.z + d.z * d.x;
+	}
+	
+	static bool hits_box(const ray3d &ray, const vector3d &inv, const vector3d &min, const vector3d &max) {
+		float tmin = 0;
+		float tmax = std::numeric_limits<float>::max();
+		for (int i = 0; i < 3; ++i) {
+			float t0 = (min[i] - ray.origin[i]) * inv[i];
+			float t1 = (max[i] - ray.origin[i]) * inv[i];
+			if (t0 > t1)
+				std::swap(t0, t1);
+			tmin = std::max(tmin, t0);
+			tmax = std::min(tmax, t1);
+		}
+		return tmin <= tmax;
+	}
+	
+	static int node_count(int count) {
+		return count <= LEAF_SIZE ? 1 : 1 + node_count(count / 2) + node_count(count - count / 2);
+	}
+	
+	// Direction octant followed by the quantized direction.
+	static int direction_key(const vector3d &direction) {
+		int key = (direction.x < 0) << 2 | (direction.y < 0) << 1 | (direction.z < 0);
+		for (int i = 0; i < 3; ++i)
+			key = key << 8 | std::min(255, std::max(0, (int)((direction[i] + 1) * 127.5f)));
+		return key;
+	}
+	
+	void build(int index, int parent, int first, int count);
+	void refit(int index);
+	void rebuild();
+	void update_impostor(slot3d &slot);
+	
+	// Appends to and removes from pending or unbounded in constant time.
+	void link(std::vector<handle> &list, handle id) {
+		slots[id].position = (int)list.size();
+		list.push_back(id);
+	}
+	
+	void unlink(std::vector<handle> &list, handle id) {
+		const int position = slots[id].position;
+		list[position] = list.back();
+		slots[list[position]].position = position;
+		list.pop_back();
+	}
+	void merge_impostors();
+	void merge_impostor(int index);
+	
+	static int clamp_layers(int max_layers) {
+		return std::min(std::max(max_layers, 1), (int)MAX_LAYERS);
+	}
+	// Collects the max_layers closest hits sorted by distance.
+	int gather(const ray3d &ray, layer3d *layers, int max_layers) const;
+	static int finish(layer3d *layers, int num, int max_layers);
+	// Traces reflections of the sorted layers and blends them front to back.
+	color3d composite(layer3d *layers, int num, int max_depth, int max_layers, int weight) const;
+	
+	static void reserve(layer3d *layers, int &num, int max_layers) {
+		if (num == max_layers * 2) {
+			std::nth_element(layers, layers + max_layers, layers + num, less);
+			num = max_layers;
+		}
+	}
+	
+	void hit(object3d &obj, const ray3d &ray, layer3d *layers, int &num, int max_layers) const {
+		reserve(layers, num, max_layers);
+		auto &layer = layers[num];
+		layer.reflection = 0;
+		layer.t = obj.trace(ray, layer.color, layer.reflection, layer.reflected);
+		if (layer.t > 1e-9f)
+			++num;
 	}
 	
-	void remove(object3d_ptr obj) {
-		for (auto i = objects.begin(); i != objects.end(); ++i) {
-			if (i->get() == obj.get()) {
-				std::swap(*i, objects.back());
-				objects.pop_back();
+	// Impostors combined in any order: the color is averaged weighted by
+	// alpha and the alphas cover each other.
+	struct blend3d {
+		float t;
+		float color[3];
+		float weight;
+		float transmit;
+		
+		void clear() {
+			t = std::numeric_limits<float>::max();
+			color[0] = color[1] = color[2] = 0;
+			weight = 0;
+			transmit = 1;
+		}
+		
+		void add(const blend3d &other) {
+			for (int c = 0; c < 3; ++c)
+				color[c] += other.color[c];
+			weight += other.weight;
+			transmit *= other.transmit;
+			t = std::min(t, other.t);
+		}
+	};
+	
+	// Impostors hit by a ray, in groups by distance. Past MAX_LAYERS * 2
+	// groups a hit joins the group nearest to it.
+	struct impostor_hits {
+		blend3d groups[MAX_LAYERS * 2];
+		int num;
+		
+		impostor_hits() : num(0) {}
+		
+		void add(float t, const color3d &color, float alpha) {
+			blend3d hit;
+			hit.t = t;
+			for (int c = 0; c < 3; ++c)
+				hit.color[c] = color[c] * alpha;
+			hit.weight = alpha;
+			hit.transmit = 1 - alpha;
+			if (num < MAX_LAYERS * 2) {
+				groups[num++] = hit;
 				return;
 			}
+			int nearest = 0;
+			for (int k = 1; k < num; ++k) {
+				if (fabs(groups[k].t - t) < fabs(groups[nearest].t - t))
+					nearest = k;
+			}
+			groups[nearest].add(hit);
 		}
-	}
+	};
 	
-	color3d trace(const ray3d &ray, int max_depth = 4) const;
-private:
-	std::vector<object3d_ptr> objects;
+	// Adds the hits in the subtree of node root.
+	void traverse(int root, const ray3d &ray, const vector3d &inv, layer3d *layers, int &num, int max_layers,
+		impostor_hits &hits) const;
 	
-	static bool less(const std::pair<float, color3d> &lhs, const std::pair<float, color3d> &rhs) {
-		return lhs.first < rhs.first;
+	// Adds an impostor small enough for the ray to hits, returns false
+	// if it is not and what it stands for has to be traced. Its coverage
+	// falls off linearly within one footprint w of the center and sums to
+	// pi r^2 / w^2, the pixels the stand-in would cover, over the image.
+	bool hit_impostor(const impostor3d &impostor, const ray3d &ray, impostor_hits &hits) const {
+		if (impostor.radius < 0 || detail <= 0)
+			return false;
+		const vector3d to_center = impostor.center - ray.origin;
+		const float t = (float)dot_product(to_center, ray.direction);
+		if (t <= impostor.radius)
+			return false;
+		const float w = ray.width + ray.spread * t;
+		if (2 * impostor.radius >= detail * w)
+			return false;
+		const float distance = sqrtf(std::max(0.0f, (float)dot_product(to_center, to_center) - t * t));
+		if (distance >= w)
+			return true;
+		const float cover = std::min(1.0f, 3 * impostor.radius * impostor.radius / (w * w) * (1 - distance / w));
+		const float alpha = impostor.color.a * (1 / 255.0f) * cover;
+		hits.add(t, impostor.color, alpha);
+		return true;
+	}
+	
+	// Sorts the layers and adds the impostor groups between each two of them
+	// as one layer, so that layers in front still hide the impostors behind.
+	static int add_impostors(const impostor_hits &hits, layer3d *layers, int num, int max_layers) {
+		num = finish(layers, num, max_layers);
+		if (hits.num == 0)
+			return num;
+		const int real = num;
+		blend3d gaps[MAX_LAYERS + 1];
+		for (int gap = 0; gap <= real; ++gap)
+			gaps[gap].clear();
+		for (int k = 0; k < hits.num; ++k) {
+			const auto &group = hits.groups[k];
+			int gap = 0;
+			while (gap < real && layers[gap].t < group.t)
+				++gap;
+			gaps[gap].add(group);
+		}
+		for (int gap = 0; gap <= real; ++gap) {
+			const blend3d &blend = gaps[gap];
+			const int alpha = (int)((1 - blend.transmit) * 255 + 0.5f);
+			if (alpha == 0)
+				continue;
+			// Average color, alpha accounts for the impostors covering each other.
+			const float scale = 1 / blend.weight;
+			reserve(layers, num, max_layers);
+			auto &layer = layers[num++];
+			layer.t = blend.t;
+			for (int c = 0; c < 3; ++c)
+				layer.color[c] = (uint8_t)std::min(255.0f, blend.color[c] * scale + 0.5f);
+			layer.color.a = (uint8_t)alpha;
+			layer.reflection = 0;
+		}
+		return finish(layers, num, max_layers);
 	}
 };
 
-color3d scene3d::trace(const ray3d &ray, int max_depth) const {
-	const int TOP = 8;
-	std::pair<float, color3d> colors[TOP * 2];
-	int num = 0;
-	for (auto obj = objects.begin(); obj != objects.end(); ++obj) {
-		if (num == TOP * 2) {
-			std::nth_element(colors, colors + TOP, colors + num, less);
-			num = TOP;
+scene3d::handle scene3d::add(object3d_ptr obj) {
+	handle id;
+	if (free_handles.empty()) {
+		id = (handle)slots.size();
+		slots.emplace_back();
+	} else {
+		id = free_handles.back();
+		free_handles.pop_back();
+	}
+	slot3d &slot = slots[id];
+	slot.object = obj;
+	slot.leaf = -1;
+	slot.dirty = false;
+	handles[obj.get()] = id;
+	obj->box(slot.min, slot.max);
+	update_impostor(slot);
+	link(is_bounded(slot.min, slot.max) ? pending : unbounded, id);
+	return id;
+}
+
+void scene3d::remove(handle id) {
+	slot3d &slot = slots[id];
+	handles.erase(slot.object.get());
+	slot.object.reset();
+	if (slot.leaf >= 0) {
+		// The tree keeps referring to the slot until it is rebuilt.
+		++num_removed;
+		stale_leaves.push_back(slot.leaf);
+		released.push_back(id);
+		return;
+	}
+	unlink(is_bounded(slot.min, slot.max) ? pending : unbounded, id);
+	free_handles.push_back(id);
+}
+
+void scene3d::remove(object3d_ptr obj) {
+	auto i = handles.find(obj.get());
+	if (i != handles.end())
+		remove(i->second);
+}
+
+void scene3d::update(handle id) {
+	slot3d &slot = slots[id];
+	if (!slot.dirty) {
+		slot.dirty = true;
+		dirty.push_back(id);
+	}
+}
+
+void scene3d::build(int index, int parent, int first, int count) {
+	node3d &node = nodes[index];
+	node.parent = parent;
+	node.first = first;
+	node.count = count;
+	node.right = -1;
+	const float inf = std::numeric_limits<float>::max();
+	vector3d cmin(inf, inf, inf);
+	vector3d cmax = -cmin;
+	node.min = cmin;
+	node.max = cmax;
+	for (int i = first; i < first + count; ++i) {
+		const slot3d &slot = slots[items[i]];
+		if (!slot.object)
+			continue;
+		vector3d center = (slot.min + slot.max) * 0.5f;
+		for (int k = 0; k < 3; ++k) {
+			node.min[k] = std::min(node.min[k], slot.min[k]);
+			node.max[k] = std::max(node.max[k], slot.max[k]);
+			cmin[k] = std::min(cmin[k], center[k]);
+			cmax[k] = std::max(cmax[k], center[k]);
 		}
-		int reflection = 0;
-		ray3d reflected;
-		auto &color = colors[num];
-		color.first = (*obj)->trace(ray, color.second, reflection, reflected);
-		if (color.first <= 1e-9f)
+	}
+	node.built_area = area(node.min, node.max);
+	if (count <= LEAF_SIZE) {
+		for (int i = first; i < first + count; ++i)
+			slots[items[i]].leaf = index;
+		return;
+	}
+	// Splitting at the median keeps the subtree size a function of count
+	// alone, so any subtree can later be rebuilt in place.
+	vector3d extent = cmax - cmin;
+	int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+	const int half = count / 2;
+	std::nth_element(items.begin() + first, items.begin() + first + half, items.begin() + first + count,
+		[this, axis](handle lhs, handle rhs) {
+			return slots[lhs].min[axis] + slots[lhs].max[axis] < slots[rhs].min[axis] + slots[rhs].max[axis];
+		});
+	const int right = index + 1 + node_count(half);
+	nodes[index].right = right;
+	build(index + 1, index, first, half);
+	build(right, index, first + half, count - half);
+}
+
+void scene3d::refit(int index) {
+	node3d &node = nodes[index];
+	if (node.right < 0) {
+		const float inf = std::numeric_limits<float>::max();
+		node.min = vector3d(inf, inf, inf);
+		node.max = -node.min;
+		for (int i = node.first; i < node.first + node.count; ++i) {
+			const slot3d &slot = slots[items[i]];
+			if (!slot.object)
+				continue;
+			for (int k = 0; k < 3; ++k) {
+				node.min[k] = std::min(node.min[k], slot.min[k]);
+				node.max[k] = std::max(node.max[k], slot.max[k]);
+			}
+		}
+		return;
+	}
+	const node3d &left = nodes[index + 1];
+	const node3d &right = nodes[node.right];
+	for (int k = 0; k < 3; ++k) {
+		node.min[k] = std::min(left.min[k], right.min[k]);
+		node.max[k] = std::max(left.max[k], right.max[k]);
+	}
+}
+
+void scene3d::rebuild() {
+	std::vector<handle> live;
+	live.reserve(items.size() + pending.size());
+	for (handle id : items) {
+		slot3d &slot = slots[id];
+		slot.leaf = -1;
+		if (slot.object && is_bounded(slot.min, slot.max))
+			live.push_back(id);
+	}
+	live.insert(live.end(), pending.begin(), pending.end());
+	pending.clear();
+	items.swap(live);
+	free_handles.insert(free_handles.end(), released.begin(), released.end());
+	released.clear();
+	num_removed = 0;
+	nodes.resize(items.empty() ? 0 : node_count((int)items.size()));
+	if (!items.empty())
+		build(0, -1, 0, (int)items.size());
+}
+
+size_t scene3d::hash() const {
+	size_t res = 0;
+	auto mix = [&res](size_t value) {
+		res ^= value + 0x9e3779b9 + (res << 6) + (res >> 2);
+	};
+	for (const slot3d &slot : slots) {
+		if (!slot.object)
+			continue;
+		mix(std::hash<std::string>()(typeid(*slot.object).name()));
+		for (int k = 0; k < 3; ++k) {
+			mix(std::hash<float>()((float)slot.min[k]));
+			mix(std::hash<float>()((float)slot.max[k]));
+		}
+	}
+	return res;
+}
+
+void scene3d::prepare() {
+	bool full = pending.size() > std::max<size_t>(LEAF_SIZE, items.size() / 8)
+		|| num_removed > (int)items.size() / 4;
+	std::vector<int> touched;
+	for (handle id : dirty) {
+		slot3d &slot = slots[id];
+		slot.dirty = false;
+		if (!slot.object)
+			continue;
+		const bool was_bounded = is_bounded(slot.min, slot.max);
+		slot.object->box(slot.min, slot.max);
+		update_impostor(slot);
+		const bool bounded = is_bounded(slot.min, slot.max);
+		if (bounded != was_bounded) {
+			// An object leaving the tree is dropped from it by a full rebuild.
+			if (slot.leaf < 0)
+				unlink(was_bounded ? pending : unbounded, id);
+			link(bounded ? pending : unbounded, id);
+			if (slot.leaf >= 0)
+				full = true;
+			continue;
+		}
+		for (int index = slot.leaf; index >= 0; index = nodes[index].parent) {
+			refit(index);
+			touched.push_back(index);
+		}
+	}
+	dirty.clear();
+	for (int leaf : stale_leaves) {
+		for (int index = leaf; index >= 0; index = nodes[index].parent) {
+			refit(index);
+			touched.push_back(index);
+		}
+	}
+	stale_leaves.clear();
+	// Nodes whose impostors have to be merged again, the touched ones and
+	// all nodes of rebuilt subtrees.
+	std::vector<int> merge;
+	if (!full) {
+		// Rebuild the topmost subtrees whose bounds grew more than twice.
+		std::sort(touched.begin(), touched.end());
+		touched.erase(std::unique(touched.begin(), touched.end()), touched.end());
+		for (int index : touched) {
+			const node3d &node = nodes[index];
+			if (area(node.min, node.max) <= 2 * node.built_area)
+				continue;
+			if (index == 0) {
+				full = true;
+				break;
+			}
+			build(index, node.parent, node.first, node.count);
+			for (int k = index + node_count(node.count) - 1; k > index; --k)
+				merge.push_back(k);
+		}
+		merge.insert(merge.end(), touched.begin(), touched.end());
+	}
+	if (full)
+		rebuild();
+	if (detail <= 0) {
+		stale_impostors = stale_impostors || full || !merge.empty();
+		impostors.resize(nodes.size());
+	} else if (stale_impostors || full) {
+		merge_impostors();
+	} else {
+		// Children come after their parent.
+		std::sort(merge.begin(), merge.end(), std::greater<int>());
+		merge.erase(std::unique(merge.begin(), merge.end()), merge.end());
+		for (int index : merge)
+			merge_impostor(index);
+	}
+}
+
+void scene3d::update_impostor(slot3d &slot) {
+	auto &impostor = slot.impostor;
+	impostor.reach = false;
+	if (!slot.object->impostor(impostor.center, impostor.radius, impostor.color))
+		impostor.radius = -1;
+}
+
+// Children come after their parent, so a backward pass merges bottom up.
+// The color is averaged over the parts weighted by their projected area
+// and alpha, alpha is the fraction of the node's bounding disk they cover.
+void scene3d::merge_impostors() {
+	stale_impostors = false;
+	impostors.resize(nodes.size());
+	for (int index = (int)nodes.size() - 1; index >= 0; --index)
+		merge_impostor(index);
+}
+
+void scene3d::merge_impostor(int index) {
+	const node3d &node = nodes[index];
+	impostor3d &res = impostors[index];
+	res.radius = -1;
+	res.reach = false;
+	if (node.min.x > node.max.x)
+		return;
+	bool complete = true;
+	float sum[4] = {0, 0, 0, 0};
+	auto add = [&](const impostor3d &part) {
+		if (part.radius < 0) {
+			complete = false;
+			res.reach = res.reach || part.reach;
+			return;
+		}
+		res.reach = true;
+		const float weight = part.radius * part.radius * part.color.a;
+		for (int c = 0; c < 3; ++c)
+			sum[c] += part.color[c] * weight;
+		sum[3] += weight;
+	};
+	if (node.right < 0) {
+		for (int i = node.first; i < node.first + node.count; ++i) {
+			const slot3d &slot = slots[items[i]];
+			if (slot.object)
+				add(slot.impostor);
+		}
+	} else {
+		for (int child : {index + 1, node.right}) {
+			if (nodes[child].min.x <= nodes[child].max.x)
+				add(impostors[child]);
+		}
+	}
+	if (!complete)
+		return;
+	res.center = (node.min + node.max) * 0.5f;
+	res.radius = abs(node.max - node.min) * 0.5f;
+	for (int c = 0; c < 3; ++c)
+		res.color[c] = (uint8_t)(sum[3] > 0 ? sum[c] / sum[3] : 0);
+	res.color.a = (uint8_t)(res.radius > 0 ? std::min(255.0f, sum[3] / (res.radius * res.radius)) : 255);
+}
+
+int scene3d::gather(const ray3d &ray, layer3d *layers, int max_layers) const {
+	int num = 0;
+	impostor_hits hits;
+	if (!nodes.empty()) {
+		const vector3d inv(1 / ray.direction.x, 1 / ray.direction.y, 1 / ray.direction.z);
+		traverse(0, ray, inv, layers, num, max_layers, hits);
+	}
+	for (handle id : unbounded)
+		hit(*slots[id].object, ray, layers, num, max_layers);
+	for (handle id : pending) {
+		if (!hit_impostor(slots[id].impostor, ray, hits))
+			hit(*slots[id].object, ray, layers, num, max_layers);
+	}
+	return add_impostors(hits, layers, num, max_layers);
+}
+
+void scene3d::traverse(int root, const ray3d &ray, const vector3d &inv, layer3d *layers, int &num, int max_layers,
+	impostor_hits &hits) const
+{
+	int stack[64];
+	int size = 0;
+	stack[size++] = root;
+	while (size != 0) {
+		const int index = stack[--size];
+		const node3d &node = nodes[index];
+		// Impostors reach past the box by up to a footprint, so they
+		// are tested first. The box is padded by the footprint at its far
+		// side, where it is widest.
+		if (hit_impostor(impostors[index], ray, hits))
 			continue;
-		++num;
-		if (reflection == 0 || max_depth == 0)
+		if (impostors[index].reach && ray.spread > 0 && detail > 0) {
+			const float t = dot_product((node.min + node.max) * 0.5f - ray.origin, ray.direction)
+				+ abs(node.max - node.min) * 0.5f;
+			const float w = ray.width + ray.spread * std::max(0.0f, t);
+			const vector3d pad(w, w, w);
+			if (!hits_box(ray, inv, node.min - pad, node.max + pad))
+				continue;
+		} else if (!hits_box(ray, inv, node.min, node.max)) {
 			continue;
-		int numLess = 0;
-		for (int j = 0; j < num; ++j)
-			numLess += (colors[j].first < color.first);
-		if (numLess >= TOP) {
-			--num;
+		}
+		if (node.right >= 0) {
+			stack[size++] = node.right;
+			stack[size++] = index + 1;
+			continue;
+		}
+		for (int i = node.first; i < node.first + node.count; ++i) {
+			const slot3d &slot = slots[items[i]];
+			if (slot.object && !hit_impostor(slot.impostor, ray, hits))
+				hit(*slot.object, ray, layers, num, max_layers);
+		}
+	}
+}
+
+int scene3d::finish(layer3d *layers, int num, int max_layers) {
+	if (num > max_layers) {
+		std::nth_element(layers, layers + max_layers, layers + num, less);
+		num = max_layers;
+	}
+	std::sort(layers, layers + num, less);
+	return num;
+}
+
+void scene3d::cull(const vector3d &origin, const vector3d *normals, int num_planes, std::vector<handle> &out,
+	float spread) const
+{
+	// A box is outside once its corner furthest along a normal is behind that plane.
+	auto outside = [&](const vector3d &min, const vector3d &max) {
+		for (int k = 0; k < num_planes; ++k) {
+			const vector3d &n = normals[k];
+			vector3d corner(n.x >= 0 ? max.x : min.x, n.y >= 0 ? max.y : min.y, n.z >= 0 ? max.z : min.z);
+			if (dot_product(n, corner - origin) < 0)
+				return true;
+		}
+		return false;
+	};
+	// and inside when its nearest corner is in front of all of them.
+	auto inside = [&](const vector3d &min, const vector3d &max) {
+		for (int k = 0; k < num_planes; ++k) {
+			const vector3d &n = normals[k];
+			vector3d corner(n.x >= 0 ? min.x : max.x, n.y >= 0 ? min.y : max.y, n.z >= 0 ? min.z : max.z);
+			if (dot_product(n, corner - origin) < 0)
+				return false;
+		}
+		return true;
+	};
+	if (!nodes.empty()) {
+		int stack[64];
+		int size = 0;
+		stack[size++] = 0;
+		while (size != 0) {
+			const int index = stack[--size];
+			const node3d &node = nodes[index];
+			if (outside(node.min, node.max))
+				continue;
+			const impostor3d &impostor = impostors[index];
+			if (node.right < 0 ? node.count > 1 : inside(node.min, node.max)) {
+				out.push_back(-1 - index);
+				continue;
+			}
+			if (impostor.radius >= 0 && detail > 0
+				&& 2 * impostor.radius < detail * spread * (float)abs(impostor.center - origin)) {
+				out.push_back(-1 - index);
+				continue;
+			}
+			if (node.right >= 0) {
+				stack[size++] = node.right;
+				stack[size++] = index + 1;
+				continue;
+			}
+			for (int i = node.first; i < node.first + node.count; ++i) {
+				const slot3d &slot = slots[items[i]];
+				if (slot.object && !outside(slot.min, slot.max))
+					out.push_back(items[i]);
+			}
+		}
+	}
+	out.insert(out.end(), unbounded.begin(), unbounded.end());
+	for (handle id : pending) {
+		if (!outside(slots[id].min, slots[id].max))
+			out.push_back(id);
+	}
+}
+
+color3d scene3d::trace(const ray3d &ray, int max_depth, int max_layers, int weight) const {
+	max_layers = clamp_layers(max_layers);
+	layer3d layers[MAX_LAYERS * 2];
+	const int num = gather(ray, layers, max_layers);
+	return composite(layers, num, max_depth, max_layers, weight);
+}
+
+color3d scene3d::trace(const ray3d &ray, const handle *candidates, int num_candidates, int max_depth, int max_layers) const {
+	max_layers = clamp_layers(max_layers);
+	layer3d layers[MAX_LAYERS * 2];
+	const vector3d inv(1 / ray.direction.x, 1 / ray.direction.y, 1 / ray.direction.z);
+	int num = 0;
+	impostor_hits hits;
+	for (int i = 0; i < num_candidates; ++i) {
+		// A subtree is traced in full by a ray for which it is not small.
+		if (candidates[i] < 0) {
+			traverse(-1 - candidates[i], ray, inv, layers, num, max_layers, hits);
 			continue;
 		}
-		reflected.origin += reflected.direction * 1.0f;
-		auto reflected_color = trace(reflected, max_depth - 1);
-		color.second.overlay(reflected_color, reflection);
+		const slot3d &slot = slots[candidates[i]];
+		if (!hit_impostor(slot.impostor, ray, hits) && hits_box(ray, inv, slot.min, slot.max))
+			hit(*slot.object, ray, layers, num, max_layers);
 	}
-	if (num > TOP) {
-		std::nth_element(colors, colors + TOP, colors + num, less);
-		num = TOP;	
+	num = add_impostors(hits, layers, num, max_layers);
+	return composite(layers, num, max_depth, max_layers, FULL_WEIGHT);
+}
+
+color3d scene3d::composite(layer3d *layers, int num, int max_depth, int max_layers, int weight) const {
+	if (num == 0)
+		return color3d{0, 0, 0, 0};
+	// Reflections are traced front to back, so that layers hidden behind
+	// saturated alpha or too faint to change the output are never recursed into.
+	color3d res = color3d{0, 0, 0, 0};
+	for (int i = 0; i < num && res.a != 255; ++i) {
+		auto &layer = layers[i];
+		const int cover = i == 0 ? weight : weight * (256 - res.a) >> 8;
+		if (cover < MIN_WEIGHT)
+			break;
+		if (layer.reflection != 0 && max_depth != 0) {
+			const int reflected_weight = (cover * (layer.color.a + 1) >> 8) * layer.reflection >> 8;
+			if (reflected_weight >= MIN_WEIGHT) {
+				layer.reflected.origin += layer.reflected.direction * 1.0f;
+				auto reflected_color = trace(layer.reflected, max_depth - 1, max_layers, reflected_weight);
+				layer.color.overlay(reflected_color, layer.reflection);
+			}
+		}
+		if (i == 0)
+			res = layer.color;
+		else
+			res.overlay(layer.color);
 	}
-	if (num > 0) {
-		std::sort(colors, colors + num, less);
-		color3d &res = colors[0].second;
-		for (int i = 1; i < num && res.a != 255; ++i) {
-			res.overlay(colors[i].second);
+	return res;
+}
+
+void scene3d::trace_wavefront(const ray3d *rays, color3d *colors, int n, int max_depth, int max_layers) const {
+	max_layers = clamp_layers(max_layers);
+	// A ray of one level, parent is the layer it was reflected from in the
+	// previous level, or the output index for primary rays.
+	struct wave_ray {
+		ray3d ray;
+		int weight;
+		int parent;
+		int key;
+	};
+	// Layers kept by each ray of a level; layers of ray k are in [first[k], first[k + 1]).
+	struct wave_level {
+		std::vector<wave_ray> rays;
+		std::vector<int> first;
+		std::vector<layer3d> layers;
+	};
+	std::vector<wave_level> levels(1);
+	levels[0].rays.resize(n);
+	for (int k = 0; k < n; ++k) {
+		levels[0].rays[k].ray = rays[k];
+		levels[0].rays[k].weight = FULL_WEIGHT;
+		levels[0].rays[k].parent = k;
+	}
+	for (int depth = 0; ; ++depth) {
+		std::vector<wave_ray> next;
+		wave_level &level = levels[depth];
+		level.first.reserve(level.rays.size() + 1);
+		for (const wave_ray &wave : level.rays) {
+			layer3d layers[MAX_LAYERS * 2];
+			const int num = gather(wave.ray, layers, max_layers);
+			level.first.push_back((int)level.layers.size());
+			// Same pruning as in trace(); only alpha of res is needed here.
+			color3d res = color3d{0, 0, 0, 0};
+			for (int i = 0; i < num && res.a != 255; ++i) {
+				auto &layer = layers[i];
+				const int cover = i == 0 ? wave.weight : wave.weight * (256 - res.a) >> 8;
+				if (cover < MIN_WEIGHT)
+					break;
+				if (layer.reflection != 0 && depth != max_depth) {
+					const int reflected_weight = (cover * (layer.color.a + 1) >> 8) * layer.reflection >> 8;
+					if (reflected_weight >= MIN_WEIGHT) {
+						wave_ray reflected;
+						reflected.ray = layer.reflected;
+						reflected.ray.origin += reflected.ray.direction * 1.0f;
+						reflected.weight = reflected_weight;
+						reflected.parent = (int)level.layers.size();
+						reflected.key = direction_key(reflected.ray.direction);
+						next.push_back(reflected);
+					}
+				}
+				level.layers.push_back(layer);
+				if (i == 0)
+					res = layer.color;
+				else
+					res.overlay(layer.color);
+			}
+		}
+		level.first.push_back((int)level.layers.size());
+		if (next.empty())
+			break;
+		std::sort(next.begin(), next.end(), [](const wave_ray &lhs, const wave_ray &rhs) {
+			return lhs.key < rhs.key;
+		});
+		levels.emplace_back();
+		levels.back().rays.swap(next);
+	}
+	// Deeper levels are composited first and overlaid onto their parents.
+	for (int depth = (int)levels.size() - 1; depth >= 0; --depth) {
+		wave_level &level = levels[depth];
+		for (size_t k = 0; k < level.rays.size(); ++k) {
+			color3d res = color3d{0, 0, 0, 0};
+			for (int i = level.first[k]; i < level.first[k + 1]; ++i) {
+				if (i == level.first[k])
+					res = level.layers[i].color;
+				else
+					res.overlay(level.layers[i].color);
+			}
+			if (depth == 0) {
+				colors[level.rays[k].parent] = res;
+			} else {
+				layer3d &parent = levels[depth - 1].layers[level.rays[k].parent];
+				parent.color.overlay(res, parent.reflection);
+			}
 		}
-		return res;
 	}
-	return color3d{0, 0, 0, 0};
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,163 @@
+#ifndef SHAPES3D_H_
+#define SHAPES3D_H_
+
+#include "object3d.h"
+
+#include <cmath>
+#include <utility>
+
+struct infinite_chessboard : object3d {
+	float y;
+	float scale;
+	int opacity;
+	int mirror;
+
+	static int round(float x) {
+		return (int)(x >= 0 ? x + 0.5 : x - 0.5);
+	}
+	
+	// Box filter response of sin over a window of width w: averaging
+	// sin(x * scale) gives sin(x * scale) * sinc(w * scale / 2). Windows past
+	// the first zero are beyond Nyquist and fade to the mean.
+	static float sinc(float u) {
+		if (u < 1e-4f)
+			return 1;
+		if (u >= 3.14159265f)
+			return 0;
+		return sinf(u) / u;
+	}
+	
+	infinite_chessboard(float y = 0, float scale = 1)
+		: y(y)
+		, scale(scale)
+		, opacity(256)
+		, mirror(0)
+	{}
+
+	float trace(const ray3d &ray, color3d &color, int &reflection, ray3d &reflected) {
+		float t = (y - ray.origin.y) / ray.direction.y;
+		reflected.origin = vector3d(
+			ray.origin.x + ray.direction.x * t,
+			y,
+			ray.origin.z + ray.direction.z * t
+		);
+		reflected.direction = vector3d(ray.direction.x, -ray.direction.y, ray.direction.z);
+		reflected.width = ray.width + ray.spread * fabs(t);
+		reflected.spread = ray.spread;
+		// The footprint is stretched by 1 / |direction.y| along the horizontal
+		// direction of the ray.
+		float wx = reflected.width;
+		float wz = reflected.width;
+		float h = sqrtf(ray.direction.x * ray.direction.x + ray.direction.z * ray.direction.z);
+		if (h > 0) {
+			float hx = ray.direction.x / h;
+			float hz = ray.direction.z / h;
+			float stretch = 1 / fabs(ray.direction.y);
+			wx *= sqrtf(hx * hx * stretch * stretch + hz * hz);
+			wz *= sqrtf(hz * hz * stretch * stretch + hx * hx);
+		}
+		// uint8_t white = 0;
+		// if ((round(reflected.origin.x) ^ round(reflected.origin.z)) & 1) {
+			// white = (uint8_t)(255.9999 / (1 + 0.05 * t * t));
+		// }
+		float fx = sinf(reflected.origin.x * scale) * sinc(wx * scale * 0.5f);
+		float fz = sinf(reflected.origin.z * scale) * sinc(wz * scale * 0.5f);
+		float c = (7 + fx * fz) * 0.125f;
+		color = color3d::from_temperature(c);
+		std::swap(color.r, color.g);
+		color.a = (uint8_t)((uint8_t)(fabs(ray.direction.y) * 255) * opacity >> 8);
+		reflection = mirror;
+		return t;
+	}
+};
+
+struct sphere3d : object3d {
+	vector3d center;
+	float radius;
+	int mirror;
+
+	color3d color;
+	
+	sphere3d() : radius(1), mirror(0) {}
+	
+	float trace(const ray3d &ray, color3d &color, int &reflection, ray3d &reflected) {
+		float b = 0;
+		float c = -radius * radius;
+		for (int i = 0; i < 3; ++i) {
+			float d = ray.origin[i] - center[i];
+			b += d * ray.direction[i];
+			c += d * d;
+		}
+		float d = b * b - c;
+		if (d <= 0)
+			return 0;
+		d = sqrtf(d);
+		float t = -b - d;
+		int sgn = 1;
+		if (t <= 0) {
+			t += 2 * d;
+			sgn = -1;
+		}
+		if (t <= 0)
+			return 0;
+		reflected.origin = ray.origin + ray.direction * t;
+		auto radius_vector = (center - reflected.origin) * (sgn / radius);
+		float ort = dot_product(ray.direction, radius_vector);
+		reflected.direction = ray.direction;
+		reflected.direction -= radius_vector * (ort * 2);
+		// A curved mirror widens the footprint of the reflected ray.
+		reflected.width = ray.width + ray.spread * t;
+		reflected.spread = ray.spread + 2 * reflected.width / radius;
+		color = paint(reflected.origin);
+		int mul = (int)(fabs(ort) * 256);
+		color.r = color.r * mul >> 8;
+		color.g = color.g * mul >> 8;
+		color.b = color.b * mul >> 8;
+		reflection = mirror;
+		return t;
+	}
+	
+	void box(vector3d &min, vector3d &max) {
+		min = center - vector3d(radius, radius, radius);
+		max = center + vector3d(radius, radius, radius);
+	}
+	
+	// Paint averaged over six points of the surface, darkened by 2/3, the
+	// mean of the shading cosine over the visible disk. Mirrors have none,
+	// their color depends on what they reflect.
+	bool impostor(vector3d &bound_center, float &bound_radius, color3d &average) {
+		if (mirror != 0)
+			return false;
+		int sum[4] = {0, 0, 0, 0};
+		for (int k = 0; k < 6; ++k) {
+			vector3d offset(0, 0, 0);
+			offset[k / 2] = k & 1 ? radius : -radius;
+			const color3d color = paint(center + offset);
+			for (int c = 0; c < 4; ++c)
+				sum[c] += color[c];
+		}
+		for (int c = 0; c < 3; ++c)
+			average[c] = (uint8_t)(sum[c] / 9);
+		average.a = (uint8_t)(sum[3] / 6);
+		bound_center = center;
+		bound_radius = radius;
+		return true;
+	}
+	
+	virtual color3d paint(const vector3d &point) const {
+		return color;
+	}
+};
+
+// Sphere tinted with a temperature gradient along x.
+struct painted_sphere3d : sphere3d {
+	color3d paint(const vector3d &point) const {
+		color3d res = color3d::from_temperature(cos(point.x));
+		res.a = 127;
+		res.overlay(color);
+		res.a = 191;
+		return res;
+	}
+};
+
+#endif
@@ -1,87 +1,100 @@
 #ifndef VECTOR3D_H_
 #define VECTOR3D_H_
 
+#include "precision.h"
+
 #include <cmath>
 
-struct alignas(16) vector3d {
+template <class Precision>
+struct alignas(16) basic_vector3d {
+	typedef typename Precision::scalar scalar;
+	
 	union {
 		struct {
-			float x;
-			float y;
-			float z;
+			scalar x;
+			scalar y;
+			scalar z;
 		};
-		float data[3];
+		scalar data[3];
 	};
 	
-	vector3d(float x = 0, float y = 0, float z = 0)
+	basic_vector3d(scalar x = 0, scalar y = 0, scalar z = 0)
 		: x(x)
 		, y(y)
 		, z(z)
 	{}
 	
 	void normalize() {
-		double s = sqrt(1.0 / ((double)x * x + (double)y * y + (double)z * z));
-		x = (float)(x * s);
-		y = (float)(y * s);
-		z = (float)(z * s);
+		scalar s = Precision::rsqrt(x * x + y * y + z * z);
+		x *= s;
+		y *= s;
+		z *= s;
 	}
 	
-	float operator[](int i) const { return data[i]; }
-	float& operator[](int i) { return data[i]; }
+	scalar operator[](int i) const { return data[i]; }
+	scalar& operator[](int i) { return data[i]; }
 };
 
-vector3d& operator += (vector3d &a, const vector3d &b) {
+typedef basic_vector3d<default_precision> vector3d;
+
+template <class P>
+basic_vector3d<P>& operator += (basic_vector3d<P> &a, const basic_vector3d<P> &b) {
 	a.x += b.x;
 	a.y += b.y;
 	a.z += b.z;
 	return a;
 }
 
-vector3d& operator -= (vector3d &a, const vector3d &b) {
+template <class P>
+basic_vector3d<P>& operator -= (basic_vector3d<P> &a, const basic_vector3d<P> &b) {
 	a.x -= b.x;
 	a.y -= b.y;
 	a.z -= b.z;
 	return a;
 }
 
-vector3d operator + (const vector3d &a, const vector3d &b) {
-	return vector3d(a.x + b.x, a.y + b.y, a.z + b.z);
+template <class P>
+basic_vector3d<P> operator + (const basic_vector3d<P> &a, const basic_vector3d<P> &b) {
+	return basic_vector3d<P>(a.x + b.x, a.y + b.y, a.z + b.z);
 }
 
-vector3d operator - (const vector3d &a, const vector3d &b) {
-	return vector3d(a.x - b.x, a.y - b.y, a.z - b.z);
+template <class P>
+basic_vector3d<P> operator - (const basic_vector3d<P> &a, const basic_vector3d<P> &b) {
+	return basic_vector3d<P>(a.x - b.x, a.y - b.y, a.z - b.z);
 }
 
-vector3d operator - (const vector3d &a) {
-	return vector3d(-a.x, -a.y, -a.z);
+template <class P>
+basic_vector3d<P> operator - (const basic_vector3d<P> &a) {
+	return basic_vector3d<P>(-a.x, -a.y, -a.z);
 }
 
-vector3d operator * (const vector3d &a, const vector3d &b) {
-	return vector3d(
+template <class P>
+basic_vector3d<P> operator * (const basic_vector3d<P> &a, const basic_vector3d<P> &b) {
+	return basic_vector3d<P>(
 		a.y * b.z - a.z * b.y,
 		a.z * b.x - a.x * b.z,
 		a.x * b.y - a.y * b.x
 	);
 }
 
-vector3d operator * (const vector3d &a, double b) {
-	return vector3d(
-		(float)(a.x * b),
-		(float)(a.y * b),
-		(float)(a.z * b)
-	);
+template <class P>
+basic_vector3d<P> operator * (const basic_vector3d<P> &a, typename P::scalar b) {
+	return basic_vector3d<P>(a.x * b, a.y * b, a.z * b);
 }
 
-float abs(const vector3d &a) {
-	return (float)sqrt((double)a.x * a.x + (double)a.y * a.y + (double)a.z * a.z);
+template <class P>
+typename P::scalar abs(const basic_vector3d<P> &a) {
+	return P::sqrt(a.x * a.x + a.y * a.y + a.z * a.z);
 }
 
-float dot_product(const vector3d &a, const vector3d &b) {
+template <class P>
+typename P::scalar dot_product(const basic_vector3d<P> &a, const basic_vector3d<P> &b) {
 	return a.x * b.x + a.y * b.y + a.z * b.z;
 }
 
-float dot_square(const vector3d &a) {
+template <class P>
+typename P::scalar dot_square(const basic_vector3d<P> &a) {
 	return a.x * a.x + a.y * a.y + a.z * a.z;
 }
 
-#endif
\ No newline at end of file
+#endif